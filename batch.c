@@ -0,0 +1,194 @@
+#include "batch.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "p2pchat.h"
+#include "transport.h"
+#include "util.h"
+#include "writing.h"
+
+// Room for the FRAME_BATCH header in front of the queued frames
+#define BATCH_HEADER_LEN (2 * sizeof(size_t))
+
+extern pthread_mutex_t peers_lock;
+extern intptr_t peers[];
+extern int num_peers;
+
+// Outgoing queue of one peer link
+typedef struct {
+  int fd;
+  bool failed;        // A flush failed; reported by the next batch_write
+  uint64_t last_ns;   // When the last frame was written or queued
+  uint64_t first_ns;  // When the oldest queued frame was queued
+  uint64_t gap_ns;    // Moving average of the time between frames
+  uint64_t retry_ns;  // When a queue waiting for the kernel is checked again
+  uint64_t delay_ns;  // How long it waited for the kernel last time
+  size_t count;       // Number of frames queued
+  size_t len;         // Bytes of frames queued
+  char* buf;          // Room for the header, then the queued frames
+} batch_link;
+
+// Protected by peers_lock
+static link_table links;
+
+// Signalled when a queue stops being empty
+static pthread_cond_t batch_cond;
+
+// Find the queue for a peer, creating it if needed
+static batch_link* find_link(int fd) {
+  batch_link* l = link_get(links, fd);
+  if (l != NULL) return l;
+
+  l = calloc(1, sizeof(*l));
+  if (l == NULL) return NULL;
+  l->fd = fd;
+  l->buf = malloc(BATCH_HEADER_LEN + BATCH_MAX_BYTES);
+  l->gap_ns = BATCH_MAX_WAIT_US * 1000;
+  if (l->buf == NULL || !link_set(links, fd, l)) {
+    free(l->buf);
+    free(l);
+    return NULL;
+  }
+  return l;
+}
+
+// How long a queue waits for another frame: twice the usual gap on the link,
+// so a frame that is merely on time still makes the batch
+static uint64_t idle_window(const batch_link* l) {
+  uint64_t wait = 2 * l->gap_ns;
+  if (wait < BATCH_MIN_WAIT_US * 1000) wait = BATCH_MIN_WAIT_US * 1000;
+  if (wait > BATCH_MAX_WAIT_US * 1000) wait = BATCH_MAX_WAIT_US * 1000;
+  return wait;
+}
+
+// Send everything queued on a link in one write. A lone frame is sent as is.
+// Unless forced, a queue waits while the kernel still has enough unsent data
+// for the link. Returns false if it waited.
+static bool flush(batch_link* l, bool force) {
+  if (l->count == 0) return true;
+  if (!force && !l->failed && !transport_writable(l->fd)) return false;
+
+  const char* start = l->buf + BATCH_HEADER_LEN;
+  size_t len = l->len;
+  if (l->count > 1) {
+    size_t kind = FRAME_BATCH;
+    memcpy(l->buf, &kind, sizeof(size_t));
+    memcpy(l->buf + sizeof(size_t), &l->len, sizeof(size_t));
+    start = l->buf;
+    len += BATCH_HEADER_LEN;
+  }
+
+  if (!l->failed && write_helper(l->fd, start, len) != (ssize_t)len) l->failed = true;
+  l->count = 0;
+  l->len = 0;
+  l->retry_ns = 0;
+  l->delay_ns = 0;
+  return true;
+}
+
+// Thread that flushes queues once their window has passed
+static void* batch_thread(void* arg) {
+  pthread_mutex_lock(&peers_lock);
+  while (1) {
+    uint64_t now = now_ns();
+    uint64_t next = UINT64_MAX;
+
+    for (int i = 0; i < num_peers; i++) {
+      batch_link* l = link_get(links, peers[i]);
+      if (l == NULL || l->count == 0) continue;
+
+      uint64_t due = l->last_ns + idle_window(l);
+      uint64_t hold = l->first_ns + BATCH_MAX_HOLD_US * 1000;
+      if (l->retry_ns > due) due = l->retry_ns;
+      if (hold < due) due = hold;
+
+      // A queue that has to wait for the kernel is checked again after twice
+      // as long as last time, and is sent anyway once it has been held for
+      // BATCH_MAX_HOLD_US
+      if (due <= now && !flush(l, now >= hold)) {
+        l->delay_ns = l->delay_ns == 0 ? BATCH_MIN_WAIT_US * 1000 : 2 * l->delay_ns;
+        l->retry_ns = now + l->delay_ns;
+        due = l->retry_ns < hold ? l->retry_ns : hold;
+      }
+      if (l->count > 0 && due < next) next = due;
+    }
+
+    // Sleep until the next queue is due, or until a queue is started
+    if (next == UINT64_MAX) {
+      pthread_cond_wait(&batch_cond, &peers_lock);
+    } else {
+      struct timespec until = {.tv_sec = next / 1000000000, .tv_nsec = next % 1000000000};
+      pthread_cond_timedwait(&batch_cond, &peers_lock, &until);
+    }
+  }
+  return NULL;
+}
+
+int batch_start() {
+  // The deadlines above are on the monotonic clock
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&batch_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, NULL, batch_thread, NULL)) return -1;
+  pthread_detach(thread_id);
+  return 0;
+}
+
+int batch_write(int fd, const void* frame, size_t len) {
+  uint64_t now = now_ns();
+  batch_link* l = find_link(fd);
+  if (l == NULL) return write_helper(fd, frame, len) == (ssize_t)len ? 0 : -1;
+  if (l->failed) return -1;
+
+  // A link that has been quiet for its whole window is idle, so nothing would
+  // join this frame. Long pauses are capped so they do not hold the average up
+  // once traffic picks up again
+  uint64_t gap = now - l->last_ns;
+  bool idle = l->count == 0 && gap >= idle_window(l);
+  uint64_t longest = BATCH_MAX_WAIT_US * 1000;
+  l->gap_ns = (7 * l->gap_ns + (gap < longest ? gap : longest)) / 8;
+  l->last_ns = now;
+
+  // Frames for an idle link, and frames too big to batch, go out right away
+  // after anything already queued
+  if (idle || len > BATCH_MAX_BYTES) {
+    flush(l, true);
+    if (!l->failed && write_helper(fd, frame, len) != (ssize_t)len) l->failed = true;
+    return l->failed ? -1 : 0;
+  }
+
+  if (l->len + len > BATCH_MAX_BYTES) flush(l, true);
+  if (l->count == 0) {
+    l->first_ns = now;
+    pthread_cond_signal(&batch_cond);
+  }
+  memcpy(l->buf + BATCH_HEADER_LEN + l->len, frame, len);
+  l->len += len;
+  l->count++;
+
+  if (l->count == BATCH_MAX_FRAMES || l->len == BATCH_MAX_BYTES) flush(l, true);
+  return l->failed ? -1 : 0;
+}
+
+int batch_flush(int fd) {
+  batch_link* l = link_get(links, fd);
+  if (l == NULL) return 0;
+  flush(l, true);
+  return l->failed ? -1 : 0;
+}
+
+void batch_peer_removed(int fd) {
+  batch_link* l = link_get(links, fd);
+  if (l == NULL) return;
+  link_set(links, fd, NULL);
+  free(l->buf);
+  free(l);
+}
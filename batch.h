@@ -0,0 +1,77 @@
+#if !defined(BATCH_H)
+#define BATCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Coalescing of small frames on busy links.
+ *
+ * A frame written to a link that has been quiet goes out right away, exactly
+ * as before. While frames keep arriving for a link faster than it has been
+ * idle, they are queued instead and sent together as one FRAME_BATCH:
+ *
+ *   size_t kind    FRAME_BATCH
+ *   size_t len     Number of bytes of frames that follow
+ *   ...            The queued frames, back to back, exactly as they would
+ *                  have been written on their own
+ *
+ * A queue is flushed once it holds BATCH_MAX_FRAMES frames or BATCH_MAX_BYTES
+ * bytes, once no frame has joined it for the link's idle window, or once its
+ * oldest frame has waited BATCH_MAX_HOLD_US. The idle window follows the gaps
+ * between frames on the link, between BATCH_MIN_WAIT_US and BATCH_MAX_WAIT_US.
+ * Under the latency transport profile, a queue that is due but not full also
+ * waits while the kernel still holds enough unsent data for the link. It is
+ * checked again after a wait that doubles each time, starting at
+ * BATCH_MIN_WAIT_US, and is sent anyway once BATCH_MAX_HOLD_US has passed.
+ *
+ * Only message frames are queued. Control frames are still written directly,
+ * right after batch_flush, so they never overtake messages queued before them.
+ * Everything here is called with peers_lock held, which also serializes the
+ * queues.
+ */
+
+// Flush a queue once it holds this many frames
+#define BATCH_MAX_FRAMES 64
+
+// Flush a queue once it holds this many bytes of frames. Receivers reject
+// batches that are any larger
+#define BATCH_MAX_BYTES (16 * 1024)
+
+// Bounds of the idle window, in microseconds
+#define BATCH_MIN_WAIT_US 20
+#define BATCH_MAX_WAIT_US 200
+
+// Longest a frame is held back, in microseconds
+#define BATCH_MAX_HOLD_US 1000
+
+/**
+ * Start the thread that flushes queues whose window has passed.
+ *
+ * \returns   0 on success, or -1 if the thread could not be created.
+ */
+int batch_start();
+
+/**
+ * Send a complete frame to a peer, or queue it to go out with the next batch.
+ *
+ * \returns   0 on success, or -1 if the link failed, now or during an earlier
+ *            flush. The caller removes the peer.
+ */
+int batch_write(int fd, const void* frame, size_t len);
+
+/**
+ * Send anything queued for a peer right away, before a control frame is
+ * written to it directly.
+ *
+ * \returns   0 on success, or -1 if the link failed, now or during an earlier
+ *            flush. The caller removes the peer.
+ */
+int batch_flush(int fd);
+
+/**
+ * Drop anything still queued for a peer that was removed.
+ */
+void batch_peer_removed(int fd);
+
+#endif
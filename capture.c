@@ -0,0 +1,182 @@
+#include "capture.h"
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Largest file descriptor that gets its own peer number
+#define CAPTURE_MAX_FD 4096
+
+// Records are buffered up to this many bytes, so recording rarely costs a
+// system call
+#define CAPTURE_BUFFER (64 * 1024)
+
+// Longest a record stays in the buffer, so a node that is killed loses little
+#define CAPTURE_FLUSH_MS 100
+
+// Protects everything below
+static pthread_mutex_t capture_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int capture_fd = -1;
+static struct timespec capture_start;
+
+// Records not written to the file yet
+static char buffer[CAPTURE_BUFFER];
+static size_t buffer_len = 0;
+
+// Peer numbers indexed by file descriptor
+static uint32_t peer_numbers[CAPTURE_MAX_FD];
+static uint32_t next_peer = 0;
+
+// Write out everything buffered. Must hold capture_lock, except when crashing.
+static void flush_buffer() {
+  size_t written = 0;
+  while (written < buffer_len) {
+    ssize_t rc = write(capture_fd, buffer + written, buffer_len - written);
+    if (rc <= 0) break;
+    written += rc;
+  }
+  buffer_len = 0;
+}
+
+// Append bytes to the buffer, writing it out when it fills up. Must hold
+// capture_lock.
+static void put(const void* data, size_t len) {
+  if (buffer_len + len > CAPTURE_BUFFER) flush_buffer();
+  if (len > CAPTURE_BUFFER) {
+    if (write(capture_fd, data, len) < 0) {
+      // Nothing to do; the capture just misses this record
+    }
+    return;
+  }
+  memcpy(buffer + buffer_len, data, len);
+  buffer_len += len;
+}
+
+// Thread that writes out buffered records every CAPTURE_FLUSH_MS until the
+// capture is closed
+static void* capture_thread(void* arg) {
+  while (1) {
+    usleep(CAPTURE_FLUSH_MS * 1000);
+    pthread_mutex_lock(&capture_lock);
+    bool running = capture_fd != -1;
+    if (running) flush_buffer();
+    pthread_mutex_unlock(&capture_lock);
+    if (!running) break;
+  }
+  return NULL;
+}
+
+// Write out what is buffered before the process dies. The default action
+// runs once the handler returns, since it is reset on entry.
+static void capture_crashed(int sig) {
+  if (capture_fd != -1) flush_buffer();
+}
+
+int capture_open(const char* path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1) return -1;
+
+  if (write(fd, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN) != CAPTURE_MAGIC_LEN) {
+    close(fd);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &capture_start);
+  capture_fd = fd;
+
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, NULL, capture_thread, NULL)) {
+    capture_fd = -1;
+    close(fd);
+    return -1;
+  }
+  pthread_detach(thread_id);
+
+  // A crash is what a capture is most often needed for
+  struct sigaction action = {.sa_handler = capture_crashed, .sa_flags = SA_RESETHAND};
+  sigemptyset(&action.sa_mask);
+  int fatal[] = {SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT};
+  for (size_t i = 0; i < sizeof(fatal) / sizeof(fatal[0]); i++) sigaction(fatal[i], &action, NULL);
+  return 0;
+}
+
+// Buffer one record. Must hold capture_lock.
+static void write_record(uint8_t type, uint32_t peer, const char** fields) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  uint64_t time_ns = (uint64_t)(now.tv_sec - capture_start.tv_sec) * 1000000000 + now.tv_nsec - capture_start.tv_nsec;
+
+  // Fields longer than a uint16_t can describe are cut short
+  uint16_t lens[4];
+  for (int i = 0; i < 4; i++) {
+    size_t len = fields[i] != NULL ? strlen(fields[i]) : 0;
+    lens[i] = len > UINT16_MAX ? UINT16_MAX : len;
+  }
+
+  char header[CAPTURE_HEADER_LEN];
+  memcpy(header, &time_ns, 8);
+  memcpy(header + 8, &type, 1);
+  memcpy(header + 9, &peer, 4);
+  memcpy(header + 13, lens, sizeof(lens));
+
+  put(header, CAPTURE_HEADER_LEN);
+  for (int i = 0; i < 4; i++) {
+    if (lens[i] > 0) put(fields[i], lens[i]);
+  }
+}
+
+void capture_peer_added(int fd) {
+  if (capture_fd == -1 || fd < 0 || fd >= CAPTURE_MAX_FD) return;
+
+  // Describe the peer by its address. Local links have no network address
+  char address[INET_ADDRSTRLEN + 8] = "local";
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr*)&addr, &addrlen) == 0 && addr.sin_family == AF_INET) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    snprintf(address, sizeof(address), "%s:%d", ip, ntohs(addr.sin_port));
+  }
+
+  pthread_mutex_lock(&capture_lock);
+  if (capture_fd != -1) {
+    peer_numbers[fd] = next_peer++;
+    const char* fields[4] = {address, NULL, NULL, NULL};
+    write_record(CAPTURE_PEER, peer_numbers[fd], fields);
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_frame(int type, int fd, const char* room, const char* message_id, const char* username,
+                   const char* message) {
+  if (capture_fd == -1 || fd >= CAPTURE_MAX_FD) return;
+
+  // Check again under the lock, in case the capture was closed meanwhile
+  pthread_mutex_lock(&capture_lock);
+  if (capture_fd != -1) {
+    uint32_t peer = fd < 0 ? CAPTURE_MULTICAST : peer_numbers[fd];
+    const char* fields[4] = {room, message_id, username, message};
+    write_record(type, peer, fields);
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
+
+void capture_close() {
+  pthread_mutex_lock(&capture_lock);
+  if (capture_fd != -1) {
+    flush_buffer();
+    close(capture_fd);
+    capture_fd = -1;
+  }
+  pthread_mutex_unlock(&capture_lock);
+}
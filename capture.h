@@ -0,0 +1,67 @@
+#if !defined(CAPTURE_H)
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/**
+ * Traffic capture.
+ *
+ * A capture file starts with CAPTURE_MAGIC and is followed by records. Every
+ * record has a fixed header and is followed by the bytes of its fields:
+ *
+ *   uint64_t time_ns   Nanoseconds since the capture started
+ *   uint8_t  type      CAPTURE_IN, CAPTURE_OUT, or CAPTURE_PEER
+ *   uint32_t peer      The peer number, or CAPTURE_MULTICAST for the group
+ *   uint16_t lens[4]   Lengths of the room, message id, username and message
+ *
+ * Peers are numbered in the order they connect, and a CAPTURE_PEER record
+ * carries the peer's address in the room field when a number is assigned. All
+ * values are in host byte order, like the frames themselves. Only frames that
+ * carry a message are recorded, not NACKs or interest summaries.
+ *
+ * Records are buffered, but written out at least every CAPTURE_FLUSH_MS and
+ * when the node crashes, so a capture of a failure ends close to the failure.
+ * The last record may be cut short.
+ */
+
+#define CAPTURE_MAGIC "P2PCAP1\n"
+#define CAPTURE_MAGIC_LEN 8
+
+// Size of a record header in the file
+#define CAPTURE_HEADER_LEN (8 + 1 + 4 + 4 * 2)
+
+// Record types
+#define CAPTURE_IN 1
+#define CAPTURE_OUT 2
+#define CAPTURE_PEER 3
+
+// Peer number used for messages sent or received through the multicast group
+#define CAPTURE_MULTICAST UINT32_MAX
+
+/**
+ * Start recording frames to a file.
+ *
+ * \returns   0 on success, or -1 with errno set if the file cannot be created.
+ */
+int capture_open(const char* path);
+
+/**
+ * Assign a peer number to a newly added peer and record its address. Does
+ * nothing unless a capture is running.
+ */
+void capture_peer_added(int fd);
+
+/**
+ * Record a frame sent to (CAPTURE_OUT) or received from (CAPTURE_IN) a peer.
+ * fd is -1 for the multicast group and room is NULL outside of rooms. Does
+ * nothing unless a capture is running.
+ */
+void capture_frame(int type, int fd, const char* room, const char* message_id, const char* username,
+                   const char* message);
+
+/**
+ * Write out what is buffered and close the capture file.
+ */
+void capture_close();
+
+#endif
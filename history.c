@@ -0,0 +1,938 @@
+#include "history.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ui.h"
+#include "util.h"
+
+#define HISTORY_MAGIC_LEN 8
+#define SEGMENT_MAGIC "P2PIDX1\n"
+
+// Longest term kept in the index. Longer words are cut off
+#define HISTORY_TERM_LEN 32
+
+// Most terms used from one query
+#define HISTORY_QUERY_TERMS 16
+
+// Slots in the in-memory term table. The index is flushed when half are used
+#define MEM_SLOTS (64 * 1024)
+
+// Most segments at once. Merging keeps the count far below this
+#define MAX_SEGMENTS 64
+
+// Size of the fixed part of a message in messages.log
+#define RECORD_HEADER_LEN (8 + 2 + 2 + 4)
+
+// Start of a segment file
+typedef struct {
+  char magic[8];
+  uint32_t first;      // First message covered
+  uint32_t end;        // One past the last message covered
+  uint32_t num_terms;  // Entries in the term table
+  uint32_t level;      // Number of merges that went into the segment
+  uint64_t table;      // Offset of the term table
+} seg_header;
+
+// Entry of a segment's term table, sorted by term
+typedef struct {
+  uint64_t term;          // Offset of the term
+  uint64_t postings;      // Offset of its postings
+  uint32_t postings_len;  // Bytes of postings
+  uint32_t count;         // Number of postings
+  uint32_t term_len;
+  uint32_t unused;
+} seg_term;
+
+// A segment mapped into memory
+typedef struct {
+  uint32_t first;
+  uint32_t end;
+  uint32_t level;
+  uint32_t num_terms;
+  const char* map;
+  size_t size;
+  const seg_term* table;
+} segment;
+
+// A growing list of message numbers
+typedef struct {
+  uint32_t* items;
+  size_t count;
+  size_t cap;
+} id_list;
+
+// A term of the in-memory index and the messages it appears in
+typedef struct {
+  char* term;  // NULL for a free slot
+  size_t term_len;
+  id_list postings;
+} mem_term;
+
+// Protects everything below
+static pthread_mutex_t history_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Signalled when a segment is added, a merge finishes, or the history closes
+static pthread_cond_t merge_cond = PTHREAD_COND_INITIALIZER;
+
+static char* history_dir = NULL;
+static int log_fd = -1;
+static int off_fd = -1;
+static uint64_t log_end;
+static uint32_t num_messages;
+
+// Segments, oldest messages first. They cover consecutive ranges, and the
+// in-memory index covers the messages from mem_first on
+static segment segments[MAX_SEGMENTS];
+static int num_segments = 0;
+static bool merging = false;
+static bool closing = false;
+
+// Cleared once the index cannot be written out, and the first message that
+// was left out of it then
+static bool indexing = true;
+static uint32_t index_end = 0;
+
+static mem_term* mem = NULL;
+static size_t mem_terms = 0;
+static size_t mem_postings = 0;
+static uint32_t mem_first = 0;
+
+static bool flush_mem();
+
+static void list_push(id_list* l, uint32_t value) {
+  if (l->count == l->cap) {
+    l->cap = l->cap == 0 ? 8 : l->cap * 2;
+    l->items = realloc(l->items, l->cap * sizeof(uint32_t));
+  }
+  l->items[l->count++] = value;
+}
+
+static bool is_word(unsigned char c) {
+  return (c >= '0' && c <= '9') || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c >= 0x80;
+}
+
+static char lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+// Read the next term of a text into term, advancing *text past it. Terms are
+// runs of letters, digits and non-ASCII bytes, lowercased. Returns the term's
+// length, or 0 at the end of the text.
+static size_t next_term(const char** text, char* term) {
+  const char* c = *text;
+  while (*c != '\0' && !is_word(*c)) c++;
+
+  size_t len = 0;
+  while (*c != '\0' && is_word(*c)) {
+    if (len < HISTORY_TERM_LEN) term[len++] = lower(*c);
+    c++;
+  }
+  *text = c;
+  return len;
+}
+
+// The term for messages sent by a user: '@' and the lowercased username
+static size_t user_term(const char* username, char* term) {
+  size_t len = 0;
+  term[len++] = '@';
+  for (const char* c = username; *c != '\0' && len < HISTORY_TERM_LEN; c++) term[len++] = lower(*c);
+  return len;
+}
+
+static int compare_terms(const char* a, size_t a_len, const char* b, size_t b_len) {
+  int cmp = memcmp(a, b, a_len < b_len ? a_len : b_len);
+  if (cmp != 0) return cmp;
+  return a_len < b_len ? -1 : a_len > b_len;
+}
+
+// Find a term in the in-memory index, adding it if create is set. Returns NULL
+// if the term is missing, or there is no free slot to add it
+static mem_term* mem_find(const char* term, size_t len, bool create) {
+  size_t slot = hash_bytes(term, len) % MEM_SLOTS;
+  size_t probes = 0;
+  while (mem[slot].term != NULL) {
+    if (mem[slot].term_len == len && memcmp(mem[slot].term, term, len) == 0) return &mem[slot];
+    if (++probes == MEM_SLOTS) return NULL;
+    slot = (slot + 1) % MEM_SLOTS;
+  }
+  if (!create) return NULL;
+
+  mem[slot].term = malloc(len);
+  memcpy(mem[slot].term, term, len);
+  mem[slot].term_len = len;
+  mem_terms++;
+  return &mem[slot];
+}
+
+static void mem_add(const char* term, size_t len, uint32_t n) {
+  mem_term* t = mem_find(term, len, true);
+  if (t == NULL) return;
+
+  // A word used twice in one message is only listed once
+  if (t->postings.count > 0 && t->postings.items[t->postings.count - 1] == n) return;
+  list_push(&t->postings, n);
+  mem_postings++;
+}
+
+// Index a message and write the in-memory index out once it is big enough.
+// Returns false, and stops indexing, if it could not be written. Must hold
+// history_lock.
+static bool index_message(uint32_t n, const char* username, const char* message) {
+  if (!indexing) return true;
+
+  char term[HISTORY_TERM_LEN];
+  mem_add(term, user_term(username, term), n);
+
+  size_t len;
+  while ((len = next_term(&message, term)) > 0) mem_add(term, len, n);
+
+  if ((mem_postings >= HISTORY_FLUSH_POSTINGS || mem_terms >= MEM_SLOTS / 2) && !flush_mem()) {
+    // Searches still cover everything indexed so far. The rest is indexed
+    // from the log the next time the history is opened
+    indexing = false;
+    index_end = n + 1;
+    return false;
+  }
+  return true;
+}
+
+/* Segment files */
+
+// Writes a segment file one term at a time
+typedef struct {
+  FILE* file;
+  uint64_t pos;
+  seg_term* table;
+  size_t num_terms;
+  size_t cap;
+  bool failed;
+} seg_writer;
+
+static void writer_bytes(seg_writer* w, const void* buf, size_t len) {
+  if (!w->failed && fwrite(buf, 1, len, w->file) != len) w->failed = true;
+  w->pos += len;
+}
+
+static bool writer_open(seg_writer* w, const char* path) {
+  memset(w, 0, sizeof(*w));
+  w->file = fopen(path, "wb");
+  if (w->file == NULL) return false;
+  setvbuf(w->file, NULL, _IOFBF, 1 << 20);
+
+  // The header is filled in once the table is written
+  seg_header header = {0};
+  writer_bytes(w, &header, sizeof(header));
+  return true;
+}
+
+// Add a term and its postings. Terms must be added in sorted order.
+static void writer_term(seg_writer* w, const char* term, size_t len, const id_list* postings) {
+  if (w->num_terms == w->cap) {
+    w->cap = w->cap == 0 ? 1024 : w->cap * 2;
+    w->table = realloc(w->table, w->cap * sizeof(seg_term));
+  }
+  seg_term* e = &w->table[w->num_terms++];
+  memset(e, 0, sizeof(*e));
+
+  e->term = w->pos;
+  e->term_len = len;
+  writer_bytes(w, term, len);
+
+  // Each message number is stored as the difference from the one before, in
+  // seven bit groups
+  e->postings = w->pos;
+  e->count = postings->count;
+  uint32_t prev = 0;
+  for (size_t i = 0; i < postings->count; i++) {
+    uint32_t delta = postings->items[i] - prev;
+    prev = postings->items[i];
+    unsigned char buf[5];
+    size_t n = 0;
+    while (delta >= 0x80) {
+      buf[n++] = (delta & 0x7f) | 0x80;
+      delta >>= 7;
+    }
+    buf[n++] = delta;
+    writer_bytes(w, buf, n);
+  }
+  e->postings_len = w->pos - e->postings;
+}
+
+static bool writer_close(seg_writer* w, uint32_t first, uint32_t end, uint32_t level) {
+  // Align the table so it can be used straight from the mapping
+  char pad[8] = {0};
+  writer_bytes(w, pad, (8 - w->pos % 8) % 8);
+
+  seg_header header = {.first = first, .end = end, .num_terms = w->num_terms, .level = level, .table = w->pos};
+  memcpy(header.magic, SEGMENT_MAGIC, sizeof(header.magic));
+  writer_bytes(w, w->table, w->num_terms * sizeof(seg_term));
+
+  if (!w->failed && (fseek(w->file, 0, SEEK_SET) || fwrite(&header, sizeof(header), 1, w->file) != 1)) {
+    w->failed = true;
+  }
+  if (fflush(w->file) || fsync(fileno(w->file))) w->failed = true;
+  fclose(w->file);
+  free(w->table);
+  return !w->failed;
+}
+
+// Map a segment file and check that everything in it is in bounds
+static bool segment_load(const char* path, segment* s) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) return false;
+  struct stat st;
+  if (fstat(fd, &st) || (size_t)st.st_size < sizeof(seg_header)) {
+    close(fd);
+    return false;
+  }
+  const char* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  const seg_header* header = (const seg_header*)map;
+  size_t size = st.st_size;
+  bool ok = memcmp(header->magic, SEGMENT_MAGIC, sizeof(header->magic)) == 0 && header->table % 8 == 0 &&
+            header->table <= size && header->num_terms <= (size - header->table) / sizeof(seg_term) &&
+            header->first <= header->end;
+  const seg_term* table = (const seg_term*)(map + (ok ? header->table : 0));
+  for (uint32_t i = 0; ok && i < header->num_terms; i++) {
+    ok = table[i].term <= size && table[i].term_len <= size - table[i].term && table[i].postings <= size &&
+         table[i].postings_len <= size - table[i].postings;
+  }
+  if (!ok) {
+    munmap((void*)map, size);
+    return false;
+  }
+
+  *s = (segment){
+      .first = header->first,
+      .end = header->end,
+      .level = header->level,
+      .num_terms = header->num_terms,
+      .map = map,
+      .size = size,
+      .table = table,
+  };
+  return true;
+}
+
+static void segment_path(uint32_t first, char* path, size_t len) {
+  snprintf(path, len, "%s/%u.seg", history_dir, first);
+}
+
+// Binary search a segment's term table
+static const seg_term* segment_find(const segment* s, const char* term, size_t len) {
+  size_t lo = 0;
+  size_t hi = s->num_terms;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const seg_term* e = &s->table[mid];
+    int cmp = compare_terms(s->map + e->term, e->term_len, term, len);
+    if (cmp == 0) return e;
+    if (cmp < 0) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return NULL;
+}
+
+// Append the postings of a term table entry to a list
+static void segment_postings(const segment* s, const seg_term* e, id_list* out) {
+  const unsigned char* p = (const unsigned char*)s->map + e->postings;
+  const unsigned char* end = p + e->postings_len;
+  uint32_t prev = 0;
+  for (uint32_t i = 0; i < e->count && p < end; i++) {
+    uint32_t delta = 0;
+    for (int shift = 0; p < end && shift < 35; shift += 7) {
+      unsigned char b = *p++;
+      delta |= (uint32_t)(b & 0x7f) << shift;
+      if (!(b & 0x80)) break;
+    }
+    prev += delta;
+    list_push(out, prev);
+  }
+}
+
+static int compare_mem_terms(const void* a, const void* b) {
+  const mem_term* x = *(const mem_term* const*)a;
+  const mem_term* y = *(const mem_term* const*)b;
+  return compare_terms(x->term, x->term_len, y->term, y->term_len);
+}
+
+// Write the in-memory index out as a new segment and empty it. Must hold
+// history_lock. Returns false, keeping the postings, if the segment cannot be
+// written.
+static bool flush_mem() {
+  if (mem_terms == 0) return true;
+  if (num_segments == MAX_SEGMENTS) return false;
+
+  mem_term** sorted = malloc(mem_terms * sizeof(mem_term*));
+  size_t n = 0;
+  for (size_t i = 0; i < MEM_SLOTS; i++) {
+    if (mem[i].term != NULL) sorted[n++] = &mem[i];
+  }
+  qsort(sorted, n, sizeof(mem_term*), compare_mem_terms);
+
+  char path[4096];
+  char tmp_path[4096 + 4];
+  segment_path(mem_first, path, sizeof(path));
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+  seg_writer w;
+  bool ok = writer_open(&w, tmp_path);
+  if (ok) {
+    for (size_t i = 0; i < n; i++) writer_term(&w, sorted[i]->term, sorted[i]->term_len, &sorted[i]->postings);
+    ok = writer_close(&w, mem_first, num_messages, 0);
+  }
+  free(sorted);
+
+  segment s;
+  if (!ok || rename(tmp_path, path) || !segment_load(path, &s)) {
+    unlink(tmp_path);
+    return false;
+  }
+  segments[num_segments++] = s;
+
+  for (size_t i = 0; i < MEM_SLOTS; i++) {
+    free(mem[i].term);
+    free(mem[i].postings.items);
+  }
+  memset(mem, 0, MEM_SLOTS * sizeof(mem_term));
+  mem_terms = 0;
+  mem_postings = 0;
+  mem_first = num_messages;
+
+  pthread_cond_broadcast(&merge_cond);
+  return true;
+}
+
+/* Merging */
+
+// Find HISTORY_MERGE_FANIN neighboring segments of the same level, newest
+// first. Returns the index of the first one, or -1. Must hold history_lock.
+static int find_merge() {
+  for (int start = num_segments - HISTORY_MERGE_FANIN; start >= 0; start--) {
+    bool same = true;
+    for (int i = 1; i < HISTORY_MERGE_FANIN && same; i++) {
+      same = segments[start + i].level == segments[start].level;
+    }
+    if (same) return start;
+  }
+  return -1;
+}
+
+// Merge segments covering consecutive ranges into one file at path
+static bool merge_into(const segment* in, int n, const char* path) {
+  seg_writer w;
+  if (!writer_open(&w, path)) return false;
+
+  size_t pos[HISTORY_MERGE_FANIN] = {0};
+  id_list postings = {0};
+  uint32_t level = 0;
+  for (int i = 0; i < n; i++) {
+    if (in[i].level >= level) level = in[i].level + 1;
+  }
+
+  while (!w.failed) {
+    // The smallest term that has not been written yet
+    const char* term = NULL;
+    size_t len = 0;
+    for (int i = 0; i < n; i++) {
+      if (pos[i] == in[i].num_terms) continue;
+      const seg_term* e = &in[i].table[pos[i]];
+      if (term == NULL || compare_terms(in[i].map + e->term, e->term_len, term, len) < 0) {
+        term = in[i].map + e->term;
+        len = e->term_len;
+      }
+    }
+    if (term == NULL) break;
+
+    // Its postings, oldest segment first, so they stay in order
+    postings.count = 0;
+    for (int i = 0; i < n; i++) {
+      if (pos[i] == in[i].num_terms) continue;
+      const seg_term* e = &in[i].table[pos[i]];
+      if (compare_terms(in[i].map + e->term, e->term_len, term, len) == 0) {
+        segment_postings(&in[i], e, &postings);
+        pos[i]++;
+      }
+    }
+    writer_term(&w, term, len, &postings);
+  }
+
+  free(postings.items);
+  return writer_close(&w, in[0].first, in[n - 1].end, level);
+}
+
+// Thread that merges segments in the background
+static void* merge_thread(void* arg) {
+  pthread_mutex_lock(&history_lock);
+  while (!closing) {
+    int start = find_merge();
+    if (start == -1) {
+      pthread_cond_wait(&merge_cond, &history_lock);
+      continue;
+    }
+
+    // Segments are never changed once written, and only this thread unmaps
+    // them, so they can be read without the lock
+    segment in[HISTORY_MERGE_FANIN];
+    memcpy(in, &segments[start], sizeof(in));
+    char path[4096];
+    char tmp_path[4096 + 4];
+    segment_path(in[0].first, path, sizeof(path));
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+    merging = true;
+    pthread_mutex_unlock(&history_lock);
+
+    // The merged segment replaces the oldest of its inputs, which has the same
+    // name. If we stop before the others are removed, history_open drops them
+    bool ok = merge_into(in, HISTORY_MERGE_FANIN, tmp_path) && rename(tmp_path, path) == 0;
+    segment merged;
+    ok = ok && segment_load(path, &merged);
+    if (!ok) unlink(tmp_path);
+
+    pthread_mutex_lock(&history_lock);
+    if (ok) {
+      for (int i = 0; i < HISTORY_MERGE_FANIN; i++) {
+        munmap((void*)in[i].map, in[i].size);
+        if (i > 0) {
+          segment_path(in[i].first, path, sizeof(path));
+          unlink(path);
+        }
+      }
+
+      // New segments may have been added after the inputs in the meantime
+      segments[start] = merged;
+      memmove(&segments[start + 1], &segments[start + HISTORY_MERGE_FANIN],
+              (num_segments - start - HISTORY_MERGE_FANIN) * sizeof(segment));
+      num_segments -= HISTORY_MERGE_FANIN - 1;
+    }
+    merging = false;
+    pthread_cond_broadcast(&merge_cond);
+
+    // Do not retry a merge that failed until something changes
+    if (!ok) pthread_cond_wait(&merge_cond, &history_lock);
+  }
+  pthread_mutex_unlock(&history_lock);
+  return NULL;
+}
+
+/* Messages */
+
+// Read message n from the log. Must hold history_lock. The caller frees the
+// strings; room is NULL outside of rooms.
+static bool read_message(uint32_t n, uint64_t* time, char** room, char** username, char** message) {
+  uint64_t offset;
+  unsigned char header[RECORD_HEADER_LEN];
+  if (pread(off_fd, &offset, sizeof(offset), (off_t)n * sizeof(offset)) != sizeof(offset)) return false;
+  if (pread(log_fd, header, sizeof(header), offset) != sizeof(header)) return false;
+
+  uint16_t room_len;
+  uint16_t username_len;
+  uint32_t message_len;
+  memcpy(time, header, 8);
+  memcpy(&room_len, header + 8, 2);
+  memcpy(&username_len, header + 10, 2);
+  memcpy(&message_len, header + 12, 4);
+
+  size_t len = (size_t)room_len + username_len + message_len;
+  char* buf = malloc(len);
+  if (buf == NULL || pread(log_fd, buf, len, offset + RECORD_HEADER_LEN) != (ssize_t)len) {
+    free(buf);
+    return false;
+  }
+
+  *room = room_len > 0 ? strndup(buf, room_len) : NULL;
+  *username = strndup(buf + room_len, username_len);
+  *message = strndup(buf + room_len + username_len, message_len);
+  free(buf);
+  return true;
+}
+
+// Length of the record a message starts with, or 0 if it is cut off
+static uint64_t record_len(uint64_t offset) {
+  unsigned char header[RECORD_HEADER_LEN];
+  if (pread(log_fd, header, sizeof(header), offset) != sizeof(header)) return 0;
+  uint16_t room_len;
+  uint16_t username_len;
+  uint32_t message_len;
+  memcpy(&room_len, header + 8, 2);
+  memcpy(&username_len, header + 10, 2);
+  memcpy(&message_len, header + 12, 4);
+  return RECORD_HEADER_LEN + room_len + username_len + message_len;
+}
+
+static int compare_segments(const void* a, const void* b) {
+  const segment* x = a;
+  const segment* y = b;
+  if (x->first != y->first) return x->first < y->first ? -1 : 1;
+  return x->end > y->end ? -1 : x->end < y->end;
+}
+
+// Map every segment in the directory. Segments left behind by an interrupted
+// merge, or that cover messages the log lost, are removed.
+static void load_segments() {
+  DIR* dir = opendir(history_dir);
+  if (dir == NULL) return;
+
+  segment found[MAX_SEGMENTS];
+  int num_found = 0;
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", history_dir, entry->d_name);
+    size_t len = strlen(entry->d_name);
+    if (len > 8 && strcmp(entry->d_name + len - 8, ".seg.tmp") == 0) {
+      unlink(path);
+      continue;
+    }
+    if (len <= 4 || strcmp(entry->d_name + len - 4, ".seg") != 0) continue;
+
+    // A segment is named after its first message
+    segment s = {0};
+    char name[32];
+    bool ok = num_found < MAX_SEGMENTS && segment_load(path, &s) && s.end <= num_messages;
+    if (ok) {
+      snprintf(name, sizeof(name), "%u.seg", s.first);
+      ok = strcmp(name, entry->d_name) == 0;
+    }
+    if (ok) {
+      found[num_found++] = s;
+    } else {
+      if (s.map != NULL) munmap((void*)s.map, s.size);
+      unlink(path);
+    }
+  }
+  closedir(dir);
+
+  // Keep the segments that continue where the previous one ended
+  qsort(found, num_found, sizeof(segment), compare_segments);
+  uint32_t next = 0;
+  for (int i = 0; i < num_found; i++) {
+    if (found[i].first == next) {
+      segments[num_segments++] = found[i];
+      next = found[i].end;
+    } else {
+      char path[4096];
+      munmap((void*)found[i].map, found[i].size);
+      segment_path(found[i].first, path, sizeof(path));
+      unlink(path);
+    }
+  }
+  mem_first = next;
+}
+
+// Unmap the segments and free the in-memory index. Must hold history_lock,
+// unless nothing else can use the history yet.
+static void free_index() {
+  for (int i = 0; i < num_segments; i++) munmap((void*)segments[i].map, segments[i].size);
+  num_segments = 0;
+  for (size_t i = 0; mem != NULL && i < MEM_SLOTS; i++) {
+    free(mem[i].term);
+    free(mem[i].postings.items);
+  }
+  free(mem);
+  mem = NULL;
+  mem_terms = 0;
+  mem_postings = 0;
+  mem_first = 0;
+  free(history_dir);
+  history_dir = NULL;
+}
+
+int history_open(const char* dir) {
+  if (mkdir(dir, 0700) == -1 && errno != EEXIST) return -1;
+
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/messages.log", dir);
+  log_fd = open(path, O_RDWR | O_CREAT, 0600);
+  snprintf(path, sizeof(path), "%s/messages.off", dir);
+  off_fd = open(path, O_RDWR | O_CREAT, 0600);
+  struct stat log_st;
+  struct stat off_st;
+  if (log_fd == -1 || off_fd == -1 || fstat(log_fd, &log_st) || fstat(off_fd, &off_st)) goto fail;
+
+  // Start a new log, or check that this is one
+  char magic[HISTORY_MAGIC_LEN];
+  if (log_st.st_size == 0) {
+    if (pwrite(log_fd, HISTORY_MAGIC, HISTORY_MAGIC_LEN, 0) != HISTORY_MAGIC_LEN) goto fail;
+    log_st.st_size = HISTORY_MAGIC_LEN;
+  } else if (pread(log_fd, magic, HISTORY_MAGIC_LEN, 0) != HISTORY_MAGIC_LEN ||
+             memcmp(magic, HISTORY_MAGIC, HISTORY_MAGIC_LEN) != 0) {
+    errno = EINVAL;
+    goto fail;
+  }
+
+  // Drop a message whose write was interrupted, in either file
+  num_messages = off_st.st_size / sizeof(uint64_t);
+  log_end = HISTORY_MAGIC_LEN;
+  while (num_messages > 0) {
+    uint64_t offset;
+    if (pread(off_fd, &offset, sizeof(offset), (off_t)(num_messages - 1) * sizeof(offset)) == sizeof(offset)) {
+      uint64_t len = record_len(offset);
+      if (len > 0 && offset + len <= (uint64_t)log_st.st_size) {
+        log_end = offset + len;
+        break;
+      }
+    }
+    num_messages--;
+  }
+  if (ftruncate(log_fd, log_end) || ftruncate(off_fd, (off_t)num_messages * sizeof(uint64_t))) goto fail;
+
+  history_dir = strdup(dir);
+  mem = calloc(MEM_SLOTS, sizeof(mem_term));
+  if (history_dir == NULL || mem == NULL) goto fail;
+  load_segments();
+
+  // Index the messages that were still in memory when the node last stopped
+  indexing = true;
+  for (uint32_t n = mem_first; n < num_messages && indexing; n++) {
+    uint64_t time;
+    char* room;
+    char* username;
+    char* message;
+    if (!read_message(n, &time, &room, &username, &message)) continue;
+    index_message(n, username, message);
+    free(room);
+    free(username);
+    free(message);
+  }
+
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, NULL, merge_thread, NULL)) goto fail;
+  pthread_detach(thread_id);
+  return 0;
+
+fail:
+  free_index();
+  if (log_fd != -1) close(log_fd);
+  if (off_fd != -1) close(off_fd);
+  log_fd = -1;
+  off_fd = -1;
+  return -1;
+}
+
+bool history_enabled() {
+  pthread_mutex_lock(&history_lock);
+  bool enabled = log_fd != -1;
+  pthread_mutex_unlock(&history_lock);
+  return enabled;
+}
+
+void history_add(const char* room, const char* username, const char* message) {
+  size_t room_len = room != NULL ? strlen(room) : 0;
+  size_t username_len = strlen(username);
+  size_t message_len = strlen(message);
+  if (room_len > UINT16_MAX) room_len = UINT16_MAX;
+  if (username_len > UINT16_MAX) username_len = UINT16_MAX;
+  if (message_len > UINT32_MAX) message_len = UINT32_MAX;
+
+  // Lay the record out in one buffer, so it is written in one call
+  size_t len = RECORD_HEADER_LEN + room_len + username_len + message_len;
+  char* record = malloc(len);
+  uint64_t now = time(NULL);
+  uint16_t lens16[2] = {room_len, username_len};
+  uint32_t len32 = message_len;
+  memcpy(record, &now, 8);
+  memcpy(record + 8, lens16, 4);
+  memcpy(record + 12, &len32, 4);
+  memcpy(record + RECORD_HEADER_LEN, room, room_len);
+  memcpy(record + RECORD_HEADER_LEN + room_len, username, username_len);
+  memcpy(record + RECORD_HEADER_LEN + room_len + username_len, message, message_len);
+
+  pthread_mutex_lock(&history_lock);
+  bool indexed = true;
+  if (log_fd != -1 && num_messages < UINT32_MAX && pwrite(log_fd, record, len, log_end) == (ssize_t)len &&
+      pwrite(off_fd, &log_end, sizeof(log_end), (off_t)num_messages * sizeof(log_end)) == sizeof(log_end)) {
+    log_end += len;
+    indexed = index_message(num_messages++, username, message);
+  }
+  pthread_mutex_unlock(&history_lock);
+  free(record);
+
+  // Only said once, since later messages are no longer indexed
+  if (!indexed) {
+    ui_display("INFO", "The search index could not be saved. New messages are kept but not indexed until restart.");
+  }
+}
+
+// Find the messages that contain every term, oldest first. Must hold
+// history_lock.
+static void find_all(char terms[][HISTORY_TERM_LEN], size_t* lens, int num_terms, id_list* result) {
+  id_list postings = {0};
+  for (int t = 0; t < num_terms; t++) {
+    // Segments cover older messages than the in-memory index, and each other
+    // in order, so the list comes out sorted
+    postings.count = 0;
+    for (int i = 0; i < num_segments; i++) {
+      const seg_term* e = segment_find(&segments[i], terms[t], lens[t]);
+      if (e != NULL) segment_postings(&segments[i], e, &postings);
+    }
+    mem_term* m = mem_find(terms[t], lens[t], false);
+    for (size_t i = 0; m != NULL && i < m->postings.count; i++) list_push(&postings, m->postings.items[i]);
+
+    if (t == 0) {
+      for (size_t i = 0; i < postings.count; i++) list_push(result, postings.items[i]);
+      continue;
+    }
+
+    // Keep only the messages in both lists
+    size_t kept = 0;
+    size_t j = 0;
+    for (size_t i = 0; i < result->count; i++) {
+      while (j < postings.count && postings.items[j] < result->items[i]) j++;
+      if (j < postings.count && postings.items[j] == result->items[i]) result->items[kept++] = result->items[i];
+    }
+    result->count = kept;
+  }
+  free(postings.items);
+}
+
+// Look up messages and show the newest matches, oldest of them first
+static void show_matches(const char* what, char terms[][HISTORY_TERM_LEN], size_t* lens, int num_terms) {
+  char summary[256];
+  char* labels[HISTORY_RESULTS];
+  char* messages[HISTORY_RESULTS];
+  int shown = 0;
+
+  pthread_mutex_lock(&history_lock);
+  if (log_fd == -1) {
+    pthread_mutex_unlock(&history_lock);
+    ui_display("INFO", "History is off. Start with P2PCHAT_HISTORY=<directory> to keep it.");
+    return;
+  }
+
+  uint64_t start = now_ns();
+  id_list found = {0};
+  find_all(terms, lens, num_terms, &found);
+  double ms = (now_ns() - start) / 1e6;
+  snprintf(summary, sizeof(summary), "%zu of %u messages %s (%.2f ms)%s", found.count,
+           indexing ? num_messages : index_end, what, ms, indexing ? "" : ". Newer messages are not indexed");
+
+  // Read the results under the lock, but show them after releasing it
+  size_t first = found.count > HISTORY_RESULTS ? found.count - HISTORY_RESULTS : 0;
+  for (size_t i = first; i < found.count; i++) {
+    uint64_t time;
+    char* room;
+    char* username;
+    if (!read_message(found.items[i], &time, &room, &username, &messages[shown])) continue;
+
+    // Label results with when they were sent, e.g. "[2024-05-01 14:03] alice #general"
+    char when[32];
+    time_t t = time;
+    struct tm tm;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime_r(&t, &tm));
+    size_t len = strlen(when) + strlen(username) + (room != NULL ? strlen(room) : 0) + 6;
+    labels[shown] = malloc(len);
+    if (room != NULL) {
+      snprintf(labels[shown], len, "[%s] %s #%s", when, username, room);
+    } else {
+      snprintf(labels[shown], len, "[%s] %s", when, username);
+    }
+    free(room);
+    free(username);
+    shown++;
+  }
+  pthread_mutex_unlock(&history_lock);
+  free(found.items);
+
+  ui_display("INFO", summary);
+  for (int i = 0; i < shown; i++) {
+    ui_display(labels[i], messages[i]);
+    free(labels[i]);
+    free(messages[i]);
+  }
+}
+
+void history_search(const char* text) {
+  char terms[HISTORY_QUERY_TERMS][HISTORY_TERM_LEN];
+  size_t lens[HISTORY_QUERY_TERMS];
+  int num_terms = 0;
+  while (num_terms < HISTORY_QUERY_TERMS && (lens[num_terms] = next_term(&text, terms[num_terms])) > 0) {
+    num_terms++;
+  }
+  if (num_terms == 0) {
+    ui_display("INFO", "Nothing to search for.");
+    return;
+  }
+  show_matches("match", terms, lens, num_terms);
+}
+
+void history_from(const char* username) {
+  char terms[1][HISTORY_TERM_LEN];
+  size_t lens[1] = {user_term(username, terms[0])};
+  show_matches("are from that user", terms, lens, 1);
+}
+
+size_t history_page(size_t end, size_t count, char** lines) {
+  pthread_mutex_lock(&history_lock);
+  size_t shown = 0;
+  if (log_fd != -1) {
+    if (end > num_messages) end = num_messages;
+    size_t start = end > count ? end - count : 0;
+    for (size_t n = start; n < end; n++) {
+      uint64_t time;
+      char* room;
+      char* username;
+      char* message;
+      if (!read_message(n, &time, &room, &username, &message)) continue;
+
+      // The same labels as the live display, e.g. "alice #general: hi"
+      size_t len = strlen(username) + (room != NULL ? strlen(room) + 2 : 0) + strlen(message) + 3;
+      lines[shown] = malloc(len);
+      if (room != NULL) {
+        snprintf(lines[shown], len, "%s #%s: %s", username, room, message);
+      } else {
+        snprintf(lines[shown], len, "%s: %s", username, message);
+      }
+      shown++;
+      free(room);
+      free(username);
+      free(message);
+    }
+  }
+  pthread_mutex_unlock(&history_lock);
+  return shown;
+}
+
+size_t history_count() {
+  pthread_mutex_lock(&history_lock);
+  size_t count = num_messages;
+  pthread_mutex_unlock(&history_lock);
+  return count;
+}
+
+void history_close() {
+  pthread_mutex_lock(&history_lock);
+  if (log_fd == -1) {
+    pthread_mutex_unlock(&history_lock);
+    return;
+  }
+
+  // Let a running merge finish, then stop the merge thread
+  closing = true;
+  pthread_cond_broadcast(&merge_cond);
+  while (merging) pthread_cond_wait(&merge_cond, &history_lock);
+
+  flush_mem();
+  free_index();
+  close(log_fd);
+  close(off_fd);
+  log_fd = -1;
+  off_fd = -1;
+  pthread_mutex_unlock(&history_lock);
+}
@@ -0,0 +1,97 @@
+#if !defined(HISTORY_H)
+#define HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * On-disk chat history with an inverted index.
+ *
+ * Every message shown in the display pane is appended to a log in the history
+ * directory, and its offset to a second file, so message n can be read back
+ * with two preads. Messages are numbered from 0 in the order they were shown.
+ *
+ * The index maps terms to the numbers of the messages that contain them. The
+ * terms of a message are the words of its text, lowercased, and its sender's
+ * username prefixed with '@'. New postings collect in memory until there are
+ * HISTORY_FLUSH_POSTINGS of them, and are then written out as an immutable
+ * segment: a sorted table of terms followed by delta-encoded posting lists.
+ * Segments are mapped into memory for searching. Whenever the
+ * HISTORY_MERGE_FANIN newest segments are of the same size class, a background
+ * thread merges them into one, so a history of n messages has O(log n)
+ * segments. Memory use stays bounded by the in-memory postings no matter how
+ * long the history grows.
+ *
+ * Files in the directory:
+ *
+ *   messages.log   HISTORY_MAGIC, then per message: uint64_t time,
+ *                  uint16_t room length, uint16_t username length, uint32_t
+ *                  message length, and the three strings
+ *   messages.off   uint64_t offset of each message in messages.log
+ *   <n>.seg        The index segment whose first message is n
+ *
+ * Postings still in memory when a node stops are rebuilt from the log when
+ * the history is opened again.
+ */
+
+#define HISTORY_MAGIC "P2PHIST1"
+
+// Flush the in-memory index to a new segment once it holds this many postings
+#define HISTORY_FLUSH_POSTINGS (128 * 1024)
+
+// Merge this many segments of the same size class into one
+#define HISTORY_MERGE_FANIN 4
+
+// Most results shown by :search and :from
+#define HISTORY_RESULTS 20
+
+/**
+ * Open or create the history in a directory, creating the directory if
+ * needed.
+ *
+ * \returns   0 on success, or -1 with errno set if the history cannot be used.
+ */
+int history_open(const char* dir);
+
+/**
+ * Check whether a history is open.
+ */
+bool history_enabled();
+
+/**
+ * Append a message that was shown to the user. Does nothing unless a history
+ * is open. room is NULL outside of rooms.
+ */
+void history_add(const char* room, const char* username, const char* message);
+
+/**
+ * Show the newest messages that contain every term in terms, and how long the
+ * search took.
+ */
+void history_search(const char* terms);
+
+/**
+ * Show the newest messages sent by a user.
+ */
+void history_from(const char* username);
+
+/**
+ * Fetch a page of scrollback for the display pane: up to count messages,
+ * oldest first, ending just before message end. Matches ui_pager_t.
+ *
+ * \returns   The number of lines stored in lines. Each is allocated with
+ *            malloc and freed by the caller.
+ */
+size_t history_page(size_t end, size_t count, char** lines);
+
+/**
+ * Count the messages in the history. Matches ui_pager_count_t.
+ */
+size_t history_count();
+
+/**
+ * Write the in-memory index to disk and close the history.
+ */
+void history_close();
+
+#endif
@@ -0,0 +1,540 @@
+#if defined(__linux__)
+#define _GNU_SOURCE
+#endif
+
+#include "local.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "p2pchat.h"
+#include "util.h"
+
+#if defined(__linux__)
+
+#include <ifaddrs.h>
+#include <poll.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+// Bytes of frame data buffered in each direction
+#define LOCAL_RING_SIZE (1 << 20)
+
+// Number of times a reader re-checks an empty ring before going to sleep
+#define LOCAL_SPIN 64
+
+// The shared memory region followed by one eventfd pair per ring
+#define LOCAL_HANDSHAKE_FDS 5
+
+// How long either side waits for the other during the handshake
+#define LOCAL_HANDSHAKE_TIMEOUT_S 1
+
+// One direction of a local link. head and tail count every byte ever written
+// and read, so head - tail is the number of bytes waiting in the ring. The
+// counters sit on separate cache lines so producer and consumer do not fight
+// over the same line.
+typedef struct {
+  _Alignas(64) _Atomic uint64_t head;
+  _Alignas(64) _Atomic uint64_t tail;
+  _Alignas(64) _Atomic uint32_t reader_waiting;
+  _Atomic uint32_t writer_waiting;
+  _Alignas(64) char data[LOCAL_RING_SIZE];
+} local_ring;
+
+// The process-local view of a link. Every write to a peer happens with
+// peers_lock held, and only the peer's reading thread reads from it, so each
+// ring has exactly one producer and one consumer.
+typedef struct {
+  int sock_fd;
+  local_ring* rings;
+  local_ring* tx;
+  local_ring* rx;
+  int tx_data_efd;   // Signalled by us when tx has new data
+  int tx_space_efd;  // Signalled by the other node when tx has room again
+  int rx_data_efd;   // Signalled by the other node when rx has new data
+  int rx_space_efd;  // Signalled by us when rx has room again
+  atomic_bool dead;
+  // One reference for the peer list and one for the reading thread
+  atomic_int refs;
+} local_link;
+
+// Local links, by the file descriptor of their Unix socket
+static link_table links;
+
+// Build the abstract Unix socket address for the node on a TCP port
+static socklen_t local_address(unsigned short port, struct sockaddr_un* addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  // A leading NUL byte puts the name in the abstract namespace, so there is no
+  // socket file to clean up when the node exits
+  int len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "p2pchat-%u", port);
+  return offsetof(struct sockaddr_un, sun_path) + 1 + len;
+}
+
+static local_link* local_lookup(int fd) {
+  return link_get(links, fd);
+}
+
+// Release one reference to a link, tearing it down with the last one
+static void local_put(local_link* l) {
+  if (atomic_fetch_sub(&l->refs, 1) != 1) return;
+
+  link_set(links, l->sock_fd, NULL);
+  munmap(l->rings, 2 * sizeof(local_ring));
+  close(l->tx_data_efd);
+  close(l->tx_space_efd);
+  close(l->rx_data_efd);
+  close(l->rx_space_efd);
+  close(l->sock_fd);
+  free(l);
+}
+
+// Map the shared rings and register a link. efds holds the data/space eventfd
+// pair of ring 0 followed by the pair of ring 1. The connecting node writes to
+// ring 0 and the accepting node writes to ring 1.
+static local_link* local_register(int sock_fd, local_ring* rings, int* efds, bool connector) {
+  if (sock_fd >= LINK_MAX_FD) return NULL;
+
+  local_link* l = malloc(sizeof(*l));
+  if (l == NULL) return NULL;
+
+  int tx = connector ? 0 : 1;
+  int rx = 1 - tx;
+  l->sock_fd = sock_fd;
+  l->rings = rings;
+  l->tx = &rings[tx];
+  l->rx = &rings[rx];
+  l->tx_data_efd = efds[2 * tx];
+  l->tx_space_efd = efds[2 * tx + 1];
+  l->rx_data_efd = efds[2 * rx];
+  l->rx_space_efd = efds[2 * rx + 1];
+  atomic_init(&l->dead, false);
+  atomic_init(&l->refs, 2);
+
+  link_set(links, sock_fd, l);
+  return l;
+}
+
+// Sleep until efd is signalled or the other node hangs up. Returns false if the
+// Unix socket reports a hangup.
+static bool local_wait(local_link* l, int efd) {
+  struct pollfd fds[2] = {
+      {.fd = efd, .events = POLLIN},
+      {.fd = l->sock_fd, .events = POLLIN},
+  };
+
+  while (poll(fds, 2, -1) < 0) {
+    if (errno != EINTR) return false;
+  }
+
+  // Drain the eventfd counter so the next wait blocks again
+  if (fds[0].revents & POLLIN) {
+    uint64_t value;
+    if (read(efd, &value, sizeof(value)) < 0) return false;
+  }
+
+  // Nothing is ever sent on the socket after the handshake, so any activity on
+  // it means the other side closed
+  return fds[1].revents == 0;
+}
+
+static void local_signal(int efd) {
+  uint64_t one = 1;
+  if (write(efd, &one, sizeof(one)) < 0) {
+    // The counter can only overflow after 2^64 wakeups; nothing to do
+  }
+}
+
+bool local_is_link(int fd) {
+  return local_lookup(fd) != NULL;
+}
+
+ssize_t local_write(int fd, const void* buf, size_t len) {
+  local_link* l = local_lookup(fd);
+  if (l == NULL) return -1;
+
+  local_ring* r = l->tx;
+  const char* ptr = buf;
+  size_t bytes_written = 0;
+
+  while (bytes_written < len) {
+    if (atomic_load(&l->dead)) return -1;
+
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_acquire);
+    size_t space = LOCAL_RING_SIZE - (size_t)(head - tail);
+
+    // Ring is full. Announce that we are waiting, then check again so a reader
+    // that freed space in between is not missed.
+    if (space == 0) {
+      atomic_store_explicit(&r->writer_waiting, 1, memory_order_relaxed);
+      atomic_thread_fence(memory_order_seq_cst);
+      bool alive = true;
+      if (atomic_load_explicit(&r->tail, memory_order_acquire) == tail) {
+        alive = local_wait(l, l->tx_space_efd);
+      }
+      atomic_store_explicit(&r->writer_waiting, 0, memory_order_relaxed);
+      if (!alive) {
+        atomic_store(&l->dead, true);
+        return -1;
+      }
+      continue;
+    }
+
+    // Copy as much as fits, wrapping around the end of the ring
+    size_t n = len - bytes_written < space ? len - bytes_written : space;
+    size_t offset = head % LOCAL_RING_SIZE;
+    size_t first = n < LOCAL_RING_SIZE - offset ? n : LOCAL_RING_SIZE - offset;
+    memcpy(r->data + offset, ptr + bytes_written, first);
+    memcpy(r->data, ptr + bytes_written + first, n - first);
+    atomic_store_explicit(&r->head, head + n, memory_order_release);
+    bytes_written += n;
+
+    // Only pay for a wakeup if the reader has gone to sleep
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->reader_waiting, memory_order_relaxed)) {
+      local_signal(l->tx_data_efd);
+    }
+  }
+
+  return (ssize_t)bytes_written;
+}
+
+ssize_t local_read(int fd, void* buf, size_t len) {
+  local_link* l = local_lookup(fd);
+  if (l == NULL) return -1;
+
+  local_ring* r = l->rx;
+  char* ptr = buf;
+  size_t bytes_read = 0;
+  bool hangup = false;
+  int spins = 0;
+
+  while (bytes_read < len) {
+    uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    size_t available = (size_t)(head - tail);
+
+    if (available == 0) {
+      // Anything written before the hangup has been consumed
+      if (hangup) {
+        atomic_store(&l->dead, true);
+        return -1;
+      }
+
+      // Re-check a few times before paying for a system call
+      if (spins++ < LOCAL_SPIN) continue;
+      spins = 0;
+
+      // Announce that we are going to sleep, then check again so a writer
+      // that published in between is not missed
+      atomic_store_explicit(&r->reader_waiting, 1, memory_order_relaxed);
+      atomic_thread_fence(memory_order_seq_cst);
+      if (atomic_load_explicit(&r->head, memory_order_acquire) == head) {
+        hangup = !local_wait(l, l->rx_data_efd);
+      }
+      atomic_store_explicit(&r->reader_waiting, 0, memory_order_relaxed);
+      continue;
+    }
+
+    size_t n = len - bytes_read < available ? len - bytes_read : available;
+    size_t offset = tail % LOCAL_RING_SIZE;
+    size_t first = n < LOCAL_RING_SIZE - offset ? n : LOCAL_RING_SIZE - offset;
+    memcpy(ptr + bytes_read, r->data + offset, first);
+    memcpy(ptr + bytes_read + first, r->data, n - first);
+    atomic_store_explicit(&r->tail, tail + n, memory_order_release);
+    bytes_read += n;
+
+    // Wake the writer if it is blocked on a full ring
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&r->writer_waiting, memory_order_relaxed)) {
+      local_signal(l->rx_space_efd);
+    }
+  }
+
+  return (ssize_t)bytes_read;
+}
+
+void local_detach(int fd) {
+  local_link* l = local_lookup(fd);
+  if (l == NULL) return;
+  atomic_store(&l->dead, true);
+  local_put(l);
+}
+
+void local_close(int fd) {
+  local_link* l = local_lookup(fd);
+  if (l == NULL) {
+    close(fd);
+    return;
+  }
+  atomic_store(&l->dead, true);
+  local_put(l);
+}
+
+// Apply the handshake timeout to both directions of a socket
+static void local_set_timeout(int fd) {
+  struct timeval tv = {.tv_sec = LOCAL_HANDSHAKE_TIMEOUT_S};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+// Send the shared memory fd and eventfds to the accepting node
+static int local_send_fds(int sock_fd, int* fds) {
+  char byte = 0;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * LOCAL_HANDSHAKE_FDS)];
+    struct cmsghdr align;
+  } control;
+  memset(&control, 0, sizeof(control));
+
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int) * LOCAL_HANDSHAKE_FDS);
+  memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * LOCAL_HANDSHAKE_FDS);
+
+  return sendmsg(sock_fd, &msg, 0) == 1 ? 0 : -1;
+}
+
+// Receive the shared memory fd and eventfds from the connecting node
+static int local_recv_fds(int sock_fd, int* fds) {
+  char byte;
+  struct iovec iov = {.iov_base = &byte, .iov_len = 1};
+  union {
+    char buf[CMSG_SPACE(sizeof(int) * LOCAL_HANDSHAKE_FDS)];
+    struct cmsghdr align;
+  } control;
+
+  struct msghdr msg = {
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control.buf,
+      .msg_controllen = sizeof(control.buf),
+  };
+  if (recvmsg(sock_fd, &msg, MSG_CMSG_CLOEXEC) != 1) return -1;
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int) * LOCAL_HANDSHAKE_FDS)) {
+    // Close whatever did arrive so it does not leak
+    if (cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS) {
+      int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      int received[count];
+      memcpy(received, CMSG_DATA(cmsg), sizeof(received));
+      for (int i = 0; i < count; i++) close(received[i]);
+    }
+    return -1;
+  }
+
+  memcpy(fds, CMSG_DATA(cmsg), sizeof(int) * LOCAL_HANDSHAKE_FDS);
+  return 0;
+}
+
+// Finish the handshake for a node that connected to our Unix socket. The
+// socket is closed if the handshake fails.
+static int local_accept(int sock_fd) {
+  local_set_timeout(sock_fd);
+
+  int fds[LOCAL_HANDSHAKE_FDS];
+  if (local_recv_fds(sock_fd, fds)) {
+    close(sock_fd);
+    return -1;
+  }
+
+  // Make sure the region is large enough before mapping it
+  local_ring* rings = MAP_FAILED;
+  struct stat st;
+  if (fstat(fds[0], &st) == 0 && st.st_size == (off_t)(2 * sizeof(local_ring))) {
+    rings = mmap(NULL, 2 * sizeof(local_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  }
+  close(fds[0]);
+
+  if (rings == MAP_FAILED || local_register(sock_fd, rings, fds + 1, false) == NULL) {
+    if (rings != MAP_FAILED) munmap(rings, 2 * sizeof(local_ring));
+    for (int i = 1; i < LOCAL_HANDSHAKE_FDS; i++) close(fds[i]);
+    close(sock_fd);
+    return -1;
+  }
+
+  // Tell the connecting node the link is ready
+  char ack = 0;
+  if (write(sock_fd, &ack, 1) != 1) {
+    // Drop both references; the last one closes the socket
+    local_close(sock_fd);
+    local_detach(sock_fd);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Thread for accepting local connections
+static void* local_accept_thread(void* arg) {
+  intptr_t server_fd = (intptr_t)arg;
+
+  while (1) {
+    int peer_fd = accept4(server_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (peer_fd < 0) continue;
+
+    if (local_accept(peer_fd) == 0) {
+      add_peer(peer_fd);
+    }
+  }
+  return NULL;
+}
+
+int local_listen(unsigned short port) {
+  int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd == -1) return -1;
+
+  struct sockaddr_un addr;
+  socklen_t addrlen = local_address(port, &addr);
+  if (bind(fd, (struct sockaddr*)&addr, addrlen) || listen(fd, SOMAXCONN)) {
+    close(fd);
+    return -1;
+  }
+
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, NULL, local_accept_thread, (void*)(intptr_t)fd)) {
+    close(fd);
+    return -1;
+  }
+  pthread_detach(thread_id);
+  return 0;
+}
+
+bool local_is_same_host(char* server_name) {
+  struct hostent* server = gethostbyname(server_name);
+  if (server == NULL || server->h_addrtype != AF_INET) return false;
+
+  // Copy the addresses out, since getifaddrs may reuse gethostbyname's storage
+  struct in_addr addrs[16];
+  int num_addrs = 0;
+  for (int i = 0; server->h_addr_list[i] != NULL && num_addrs < 16; i++) {
+    memcpy(&addrs[num_addrs++], server->h_addr_list[i], sizeof(struct in_addr));
+  }
+
+  // Any address in 127.0.0.0/8 is this host
+  for (int i = 0; i < num_addrs; i++) {
+    if ((ntohl(addrs[i].s_addr) >> 24) == 127) return true;
+  }
+
+  // Otherwise compare against the addresses of our own interfaces
+  struct ifaddrs* ifaddr;
+  if (getifaddrs(&ifaddr)) return false;
+
+  bool same = false;
+  for (struct ifaddrs* ifa = ifaddr; ifa != NULL && !same; ifa = ifa->ifa_next) {
+    if (ifa->ifa_addr == NULL || ifa->ifa_addr->sa_family != AF_INET) continue;
+    struct in_addr local = ((struct sockaddr_in*)ifa->ifa_addr)->sin_addr;
+    for (int i = 0; i < num_addrs; i++) {
+      if (addrs[i].s_addr == local.s_addr) same = true;
+    }
+  }
+
+  freeifaddrs(ifaddr);
+  return same;
+}
+
+int local_connect(unsigned short port) {
+  int sock_fd = -1;
+  int fds[LOCAL_HANDSHAKE_FDS];
+  for (int i = 0; i < LOCAL_HANDSHAKE_FDS; i++) fds[i] = -1;
+  local_ring* rings = MAP_FAILED;
+
+  // Create the shared region. ftruncate zero-fills it, so both rings start
+  // empty.
+  fds[0] = memfd_create("p2pchat", MFD_CLOEXEC);
+  if (fds[0] == -1 || ftruncate(fds[0], 2 * sizeof(local_ring))) goto fail;
+  rings = mmap(NULL, 2 * sizeof(local_ring), PROT_READ | PROT_WRITE, MAP_SHARED, fds[0], 0);
+  if (rings == MAP_FAILED) goto fail;
+
+  for (int i = 1; i < LOCAL_HANDSHAKE_FDS; i++) {
+    fds[i] = eventfd(0, EFD_CLOEXEC);
+    if (fds[i] == -1) goto fail;
+  }
+
+  // Reach the node through its abstract Unix socket
+  sock_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sock_fd == -1) goto fail;
+  struct sockaddr_un addr;
+  socklen_t addrlen = local_address(port, &addr);
+  if (connect(sock_fd, (struct sockaddr*)&addr, addrlen)) goto fail;
+
+  local_set_timeout(sock_fd);
+  if (local_send_fds(sock_fd, fds)) goto fail;
+
+  // Wait for the accepting node to map the region
+  char ack;
+  if (read(sock_fd, &ack, 1) != 1) goto fail;
+
+  if (local_register(sock_fd, rings, fds + 1, true) == NULL) goto fail;
+  close(fds[0]);
+  return sock_fd;
+
+fail:
+  if (rings != MAP_FAILED) munmap(rings, 2 * sizeof(local_ring));
+  for (int i = 0; i < LOCAL_HANDSHAKE_FDS; i++) {
+    if (fds[i] != -1) close(fds[i]);
+  }
+  if (sock_fd != -1) close(sock_fd);
+  return -1;
+}
+
+#else
+
+// Without memfd and eventfd there is no local transport; every peer uses TCP
+
+int local_listen(unsigned short port) {
+  return -1;
+}
+
+bool local_is_same_host(char* server_name) {
+  return false;
+}
+
+int local_connect(unsigned short port) {
+  return -1;
+}
+
+bool local_is_link(int fd) {
+  return false;
+}
+
+ssize_t local_write(int fd, const void* buf, size_t len) {
+  return -1;
+}
+
+ssize_t local_read(int fd, void* buf, size_t len) {
+  return -1;
+}
+
+void local_detach(int fd) {}
+
+void local_close(int fd) {
+  close(fd);
+}
+
+#endif
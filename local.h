@@ -0,0 +1,79 @@
+#if !defined(LOCAL_H)
+#define LOCAL_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+/**
+ * Local transport for peers running on the same host.
+ *
+ * The two nodes meet on a Unix-domain socket named after the listening TCP
+ * port, exchange a shared memory region and a set of eventfds, and then move
+ * frames through a pair of single-producer/single-consumer ring buffers. The
+ * Unix socket is kept open for the life of the link: its file descriptor is the
+ * one stored in the peer list, and its hangup tells either side that the other
+ * node went away. Only Linux builds get a real implementation; elsewhere every
+ * function reports that no local link exists, so the TCP path is used.
+ */
+
+/**
+ * Start accepting local connections for the node listening on a TCP port.
+ *
+ * \param port  The TCP port of this node's server socket.
+ *
+ * \returns     0 on success, or -1 if the local transport is unavailable.
+ */
+int local_listen(unsigned short port);
+
+/**
+ * Check whether a host name refers to the machine this node is running on.
+ *
+ * \param server_name   A host name or IP address, as passed to socket_connect.
+ *
+ * \returns   true if the address is a loopback address or one of our own
+ *            interface addresses.
+ */
+bool local_is_same_host(char* server_name);
+
+/**
+ * Connect to the node on this host that listens on a TCP port.
+ *
+ * \param port  The TCP port of the node to connect to.
+ *
+ * \returns   A file descriptor to store in the peer list, or -1 if the local
+ *            transport could not be set up and TCP should be used instead.
+ */
+int local_connect(unsigned short port);
+
+/**
+ * Check whether a peer file descriptor refers to a local link.
+ */
+bool local_is_link(int fd);
+
+/**
+ * Write all len bytes to a local link, blocking while the ring is full.
+ *
+ * \returns   len on success, or -1 if the other node went away.
+ */
+ssize_t local_write(int fd, const void* buf, size_t len);
+
+/**
+ * Read exactly len bytes from a local link, blocking while the ring is empty.
+ *
+ * \returns   len on success, or -1 if the other node went away first.
+ */
+ssize_t local_read(int fd, void* buf, size_t len);
+
+/**
+ * Called by a peer's reading thread once it stops reading. Has no effect on
+ * TCP connections.
+ */
+void local_detach(int fd);
+
+/**
+ * Close a peer connection. Local links release their shared memory once the
+ * reading thread has also detached; any other fd is simply closed.
+ */
+void local_close(int fd);
+
+#endif
@@ -0,0 +1,577 @@
+#include "multicast.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "batch.h"
+#include "capture.h"
+#include "p2pchat.h"
+#include "reading.h"
+#include "rooms.h"
+#include "sanitize.h"
+#include "transport.h"
+#include "ui.h"
+#include "util.h"
+#include "writing.h"
+
+// Marks our datagrams so stray traffic on the group port is ignored
+#define MCAST_MAGIC 0x50325043
+
+// Datagram types
+#define MCAST_DATA 1
+#define MCAST_HEARTBEAT 2
+
+// Largest datagram we send or accept: a header and three fields
+#define MCAST_DATAGRAM_MAX (sizeof(mcast_header) + 3 * (sizeof(size_t) + MESSAGE_LEN))
+
+// Number of recent messages kept to answer NACKs from peers
+#define MCAST_CACHE 1024
+
+// Number of distinct senders whose sequence numbers we track
+#define MCAST_SENDERS 256
+
+// Outstanding sequence numbers tracked per sender, and the most one NACK asks for
+#define MCAST_MISSING 64
+
+// How many times a missing message is requested before we give up on it
+#define MCAST_NACK_TRIES 5
+
+// How often we send a heartbeat and retry outstanding NACKs
+#define MCAST_TICK_MS 500
+
+extern pthread_mutex_t peers_lock;
+extern intptr_t peers[];
+extern int num_peers;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t type;
+  uint64_t sender;
+  uint64_t seq;  // The message's sequence number, or the latest one for a heartbeat
+} mcast_header;
+
+// What we know about one sender's sequence numbers
+typedef struct {
+  uint64_t id;
+  uint64_t expected;  // The sequence number after the highest one we have seen
+  uint64_t missing[MCAST_MISSING];
+  int tries[MCAST_MISSING];
+  int num_missing;
+} mcast_sender;
+
+// A recently seen message, kept so we can repair it for a neighbor
+typedef struct {
+  uint64_t sender;
+  uint64_t seq;
+  char* message_id;
+  char* username;
+  char* message;
+} mcast_entry;
+
+// A neighbor's node id, from the FRAME_GROUP it sent for our group
+typedef struct {
+  uint64_t node;
+} mcast_link;
+
+// Protects everything below except the socket
+static pthread_mutex_t mcast_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int mcast_fd = -1;
+static struct sockaddr_in mcast_group;
+static char** mcast_seen;
+
+// Our node id and the sequence number of the last message we sent
+static uint64_t node_id;
+static uint64_t last_seq = 0;
+
+static mcast_sender senders[MCAST_SENDERS];
+static int num_senders = 0;
+
+static mcast_entry cache[MCAST_CACHE];
+static uint64_t cache_next = 0;
+
+static link_table links;
+
+// Pick a node id that is unique even if two nodes share a username
+static uint64_t random_id() {
+  uint64_t id = 0;
+  int fd = open("/dev/urandom", O_RDONLY);
+  if (fd == -1 || read(fd, &id, sizeof(id)) != sizeof(id)) {
+    id = ((uint64_t)time(NULL) << 32) ^ (uint64_t)getpid();
+  }
+  if (fd != -1) close(fd);
+  return id;
+}
+
+// Find a sender's state, creating it on first contact. Must hold mcast_lock.
+static mcast_sender* find_sender(uint64_t id, bool* created) {
+  *created = false;
+  for (int i = 0; i < num_senders; i++) {
+    if (senders[i].id == id) return &senders[i];
+  }
+  if (num_senders == MCAST_SENDERS) return NULL;
+
+  mcast_sender* s = &senders[num_senders++];
+  memset(s, 0, sizeof(*s));
+  s->id = id;
+  *created = true;
+  return s;
+}
+
+// Record a sequence number from a sender. A received message fills its own
+// slot; a heartbeat only tells us how far the sender has got. Anything skipped
+// becomes missing, and *gap is set. Returns true if this is the first time the
+// message arrived. Must hold mcast_lock.
+static bool note_seq(uint64_t id, uint64_t seq, bool received, bool* gap) {
+  *gap = false;
+  bool created;
+  mcast_sender* s = find_sender(id, &created);
+  if (s == NULL) return received;
+
+  // Nodes that joined late do not ask for history
+  if (created) {
+    s->expected = seq + 1;
+    return received;
+  }
+
+  if (seq >= s->expected) {
+    // Everything between the last message and this one was lost. A heartbeat's
+    // own sequence number is lost as well.
+    uint64_t end = received ? seq : seq + 1;
+    uint64_t start = s->expected;
+    if (end - start > MCAST_MISSING) start = end - MCAST_MISSING;
+    for (uint64_t q = start; q < end && s->num_missing < MCAST_MISSING; q++) {
+      s->missing[s->num_missing] = q;
+      s->tries[s->num_missing] = 0;
+      s->num_missing++;
+      *gap = true;
+    }
+    s->expected = seq + 1;
+    return received;
+  }
+
+  // An older message: only new if we were still waiting for it
+  for (int i = 0; i < s->num_missing; i++) {
+    if (s->missing[i] == seq) {
+      s->num_missing--;
+      s->missing[i] = s->missing[s->num_missing];
+      s->tries[i] = s->tries[s->num_missing];
+      return received;
+    }
+  }
+  return false;
+}
+
+// Keep a copy of a message for repairs. Must hold mcast_lock.
+static void cache_add(uint64_t sender, uint64_t seq, const char* message_id, const char* username,
+                      const char* message) {
+  mcast_entry* e = &cache[cache_next++ % MCAST_CACHE];
+  free(e->message_id);
+  free(e->username);
+  free(e->message);
+  e->sender = sender;
+  e->seq = seq;
+  e->message_id = strdup(message_id);
+  e->username = strdup(username);
+  e->message = strdup(message);
+}
+
+// Ask every TCP peer for the messages we are missing
+static void send_nacks() {
+  // Build every NACK frame under mcast_lock, then send them under peers_lock
+  size_t frame_max = sizeof(size_t) + sizeof(uint64_t) + sizeof(uint32_t) + MCAST_MISSING * sizeof(uint64_t);
+  char* frames = NULL;
+  size_t len = 0;
+
+  pthread_mutex_lock(&mcast_lock);
+  for (int i = 0; i < num_senders; i++) {
+    mcast_sender* s = &senders[i];
+
+    // Drop anything we have asked for too many times
+    for (int j = 0; j < s->num_missing; j++) {
+      if (++s->tries[j] > MCAST_NACK_TRIES) {
+        s->num_missing--;
+        s->missing[j] = s->missing[s->num_missing];
+        s->tries[j] = s->tries[s->num_missing];
+        j--;
+      }
+    }
+    if (s->num_missing == 0) continue;
+
+    frames = realloc(frames, len + frame_max);
+    size_t kind = FRAME_NACK;
+    uint32_t count = s->num_missing;
+    memcpy(frames + len, &kind, sizeof(size_t));
+    len += sizeof(size_t);
+    memcpy(frames + len, &s->id, sizeof(uint64_t));
+    len += sizeof(uint64_t);
+    memcpy(frames + len, &count, sizeof(uint32_t));
+    len += sizeof(uint32_t);
+    memcpy(frames + len, s->missing, count * sizeof(uint64_t));
+    len += count * sizeof(uint64_t);
+  }
+  pthread_mutex_unlock(&mcast_lock);
+
+  if (len == 0) return;
+
+  bool removed = false;
+  pthread_mutex_lock(&peers_lock);
+  for (int i = 0; i < num_peers; i++) {
+    if (batch_flush(peers[i]) || write_helper(peers[i], frames, len) != (ssize_t)len) {
+      remove_peer(peers[i]);
+      removed = true;
+      i--;
+    }
+  }
+  pthread_mutex_unlock(&peers_lock);
+  free(frames);
+
+  if (removed) rooms_advertise();
+}
+
+// Append a length-prefixed field to a datagram
+static size_t put_field(char* buf, size_t pos, const char* field) {
+  size_t len = strlen(field);
+  memcpy(buf + pos, &len, sizeof(size_t));
+  memcpy(buf + pos + sizeof(size_t), field, len);
+  return pos + sizeof(size_t) + len;
+}
+
+// Copy a length-prefixed field out of a datagram. Returns NULL if it is
+// truncated or too long.
+static char* take_field(const char** pos, const char* end) {
+  size_t len;
+  if (end - *pos < (ptrdiff_t)sizeof(size_t)) return NULL;
+  memcpy(&len, *pos, sizeof(size_t));
+  *pos += sizeof(size_t);
+  if (len > MESSAGE_LEN || end - *pos < (ptrdiff_t)len) return NULL;
+
+  char* field = malloc(len + 1);
+  memcpy(field, *pos, len);
+  field[len] = '\0';
+  *pos += len;
+  return field;
+}
+
+// Handle one datagram from the group
+static void multicast_receive(const char* buf, size_t len) {
+  mcast_header header;
+  memcpy(&header, buf, sizeof(header));
+  if (header.magic != MCAST_MAGIC || header.sender == node_id) return;
+
+  bool gap;
+  if (header.type == MCAST_HEARTBEAT) {
+    pthread_mutex_lock(&mcast_lock);
+    note_seq(header.sender, header.seq, false, &gap);
+    pthread_mutex_unlock(&mcast_lock);
+    if (gap) send_nacks();
+    return;
+  }
+  if (header.type != MCAST_DATA) return;
+
+  const char* pos = buf + sizeof(header);
+  const char* end = buf + len;
+  char* message_id = take_field(&pos, end);
+  char* username = message_id ? take_field(&pos, end) : NULL;
+  char* message = username ? take_field(&pos, end) : NULL;
+
+  if (message != NULL) {
+    // Both end up on the terminal, so strip control characters and bad UTF-8
+    sanitize_text(username, strlen(username));
+    sanitize_text(message, strlen(message));
+
+    pthread_mutex_lock(&mcast_lock);
+    bool fresh = note_seq(header.sender, header.seq, true, &gap);
+    if (fresh) cache_add(header.sender, header.seq, message_id, username, message);
+    pthread_mutex_unlock(&mcast_lock);
+
+    capture_frame(CAPTURE_IN, -1, NULL, message_id, username, message);
+
+    // Everyone else in the group received the datagram too, so it only goes
+    // on to neighbors outside the group
+    if (seen_add(mcast_seen, message_id)) {
+      rooms_display(NULL, username, message);
+      broadcast_outside_group(username, message, message_id);
+    }
+
+    // Ask for anything this message skipped over right away
+    if (gap) send_nacks();
+  }
+
+  free(message_id);
+  free(username);
+  free(message);
+}
+
+// Thread that receives from the group and runs the heartbeat/retry timer
+static void* multicast_thread(void* arg) {
+  char* buf = malloc(MCAST_DATAGRAM_MAX);
+  struct timespec last_tick;
+  clock_gettime(CLOCK_MONOTONIC, &last_tick);
+
+  while (1) {
+    ssize_t len = recv(mcast_fd, buf, MCAST_DATAGRAM_MAX, 0);
+    if (len >= (ssize_t)sizeof(mcast_header)) multicast_receive(buf, len);
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long elapsed_ms = (now.tv_sec - last_tick.tv_sec) * 1000 + (now.tv_nsec - last_tick.tv_nsec) / 1000000;
+    if (elapsed_ms < MCAST_TICK_MS) continue;
+    last_tick = now;
+
+    // Let receivers notice if our latest message was lost, and let neighbors
+    // know that our datagrams reach them even before we send a message
+    pthread_mutex_lock(&mcast_lock);
+    mcast_header heartbeat = {.magic = MCAST_MAGIC, .type = MCAST_HEARTBEAT, .sender = node_id, .seq = last_seq};
+    pthread_mutex_unlock(&mcast_lock);
+    sendto(mcast_fd, &heartbeat, sizeof(heartbeat), 0, (struct sockaddr*)&mcast_group, sizeof(mcast_group));
+
+    // Retry NACKs nobody has answered yet
+    send_nacks();
+  }
+
+  free(buf);
+  return NULL;
+}
+
+int multicast_open(const char* spec, char** seen) {
+  // Parse "<group>:<port>", optionally followed by "@<interface address>"
+  char group[64];
+  char interface[64] = "";
+  unsigned short port;
+  if (sscanf(spec, "%63[^:]:%hu@%63s", group, &port, interface) < 2) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  struct in_addr group_addr;
+  struct in_addr interface_addr = {.s_addr = INADDR_ANY};
+  if (inet_aton(group, &group_addr) == 0 || (interface[0] != '\0' && inet_aton(interface, &interface_addr) == 0)) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd == -1) return -1;
+
+  // Several nodes on one host share the group port
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#if defined(SO_REUSEPORT)
+  setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#endif
+
+  struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_addr.s_addr = INADDR_ANY,
+      .sin_port = htons(port),
+  };
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+    close(fd);
+    return -1;
+  }
+
+  // Join the group, stay on the local segment, and hear nodes on this host
+  struct ip_mreq mreq = {.imr_multiaddr = group_addr, .imr_interface = interface_addr};
+  unsigned char ttl = 1;
+  unsigned char loop = 1;
+  if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) ||
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) ||
+      setsockopt(fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof(loop)) ||
+      (interface[0] != '\0' &&
+       setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &interface_addr, sizeof(interface_addr)))) {
+    close(fd);
+    return -1;
+  }
+
+#if defined(IP_MULTICAST_ALL)
+  // Only hear groups this socket joined, not every group joined on the host
+  int all = 0;
+  setsockopt(fd, IPPROTO_IP, IP_MULTICAST_ALL, &all, sizeof(all));
+#endif
+
+  // Wake up regularly for heartbeats and NACK retries
+  struct timeval tv = {.tv_sec = 0, .tv_usec = MCAST_TICK_MS * 1000};
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  mcast_group = (struct sockaddr_in){.sin_family = AF_INET, .sin_addr = group_addr, .sin_port = htons(port)};
+  mcast_seen = seen;
+  node_id = random_id();
+  mcast_fd = fd;
+
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, NULL, multicast_thread, NULL)) {
+    mcast_fd = -1;
+    close(fd);
+    return -1;
+  }
+  pthread_detach(thread_id);
+  return 0;
+}
+
+bool multicast_enabled() {
+  return mcast_fd != -1;
+}
+
+int multicast_send(const char* username, const char* message, const char* message_id) {
+  if (strlen(message_id) > MESSAGE_LEN || strlen(username) > MESSAGE_LEN || strlen(message) > MESSAGE_LEN) {
+    errno = EMSGSIZE;
+    return -1;
+  }
+
+  char* buf = malloc(MCAST_DATAGRAM_MAX);
+  mcast_header header = {.magic = MCAST_MAGIC, .type = MCAST_DATA, .sender = node_id};
+
+  // Number the message and keep it for repairs
+  pthread_mutex_lock(&mcast_lock);
+  header.seq = ++last_seq;
+  cache_add(node_id, header.seq, message_id, username, message);
+  pthread_mutex_unlock(&mcast_lock);
+
+  memcpy(buf, &header, sizeof(header));
+  size_t len = sizeof(header);
+  len = put_field(buf, len, message_id);
+  len = put_field(buf, len, username);
+  len = put_field(buf, len, message);
+
+  ssize_t rc = sendto(mcast_fd, buf, len, 0, (struct sockaddr*)&mcast_group, sizeof(mcast_group));
+  free(buf);
+  capture_frame(CAPTURE_OUT, -1, NULL, message_id, username, message);
+  return rc == (ssize_t)len ? 0 : -1;
+}
+
+// Identify our group by its address and port
+static uint64_t group_key() {
+  return (uint64_t)ntohl(mcast_group.sin_addr.s_addr) << 16 | ntohs(mcast_group.sin_port);
+}
+
+void multicast_peer_added(int fd) {
+  if (!multicast_enabled()) return;
+
+  char frame[sizeof(size_t) + 2 * sizeof(uint64_t)];
+  size_t kind = FRAME_GROUP;
+  uint64_t group = group_key();
+  memcpy(frame, &kind, sizeof(size_t));
+  memcpy(frame + sizeof(size_t), &group, sizeof(uint64_t));
+  memcpy(frame + sizeof(size_t) + sizeof(uint64_t), &node_id, sizeof(uint64_t));
+  if (batch_flush(fd) == 0) write_helper(fd, frame, sizeof(frame));
+}
+
+void multicast_peer_group(int fd, uint64_t group, uint64_t node) {
+  if (!multicast_enabled() || group != group_key()) return;
+
+  pthread_mutex_lock(&mcast_lock);
+  mcast_link* l = link_get(links, fd);
+  if (l == NULL && (l = malloc(sizeof(*l))) != NULL && !link_set(links, fd, l)) {
+    free(l);
+    l = NULL;
+  }
+  if (l != NULL) l->node = node;
+  pthread_mutex_unlock(&mcast_lock);
+}
+
+bool multicast_is_member(int fd) {
+  pthread_mutex_lock(&mcast_lock);
+  bool member = false;
+  mcast_link* l = link_get(links, fd);
+
+  // Only a neighbor whose datagrams we hear is on our segment
+  for (int i = 0; l != NULL && i < num_senders && !member; i++) member = senders[i].id == l->node;
+  pthread_mutex_unlock(&mcast_lock);
+  return member;
+}
+
+void multicast_peer_removed(int fd) {
+  pthread_mutex_lock(&mcast_lock);
+  mcast_link* l = link_get(links, fd);
+  link_set(links, fd, NULL);
+  free(l);
+  pthread_mutex_unlock(&mcast_lock);
+}
+
+int multicast_handle_nack(int fd) {
+  uint64_t sender;
+  uint32_t count;
+  if (read_helper(fd, &sender, sizeof(uint64_t)) != sizeof(uint64_t)) return -1;
+  if (read_helper(fd, &count, sizeof(uint32_t)) != sizeof(uint32_t)) return -1;
+  if (count > MCAST_MISSING) return -1;
+
+  uint64_t seqs[MCAST_MISSING];
+  if (count > 0 && read_helper(fd, seqs, count * sizeof(uint64_t)) != count * sizeof(uint64_t)) return -1;
+
+  // Copy out every requested message we still have
+  mcast_entry found[MCAST_MISSING];
+  int num_found = 0;
+  pthread_mutex_lock(&mcast_lock);
+  for (uint32_t i = 0; i < count; i++) {
+    for (int j = 0; j < MCAST_CACHE; j++) {
+      mcast_entry* e = &cache[j];
+      if (e->message_id != NULL && e->sender == sender && e->seq == seqs[i]) {
+        found[num_found++] = (mcast_entry){
+            .sender = sender,
+            .seq = e->seq,
+            .message_id = strdup(e->message_id),
+            .username = strdup(e->username),
+            .message = strdup(e->message),
+        };
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&mcast_lock);
+
+  // Answer on the link the NACK came from. Writes to peers are serialized by
+  // peers_lock, like broadcast()
+  pthread_mutex_lock(&peers_lock);
+  transport_cork(fd, true);
+  bool ok = batch_flush(fd) == 0;
+  for (int i = 0; i < num_found; i++) {
+    mcast_entry* e = &found[i];
+    size_t kind = FRAME_REPAIR;
+    size_t milen = strlen(e->message_id);
+    size_t ulen = strlen(e->username);
+    size_t mlen = strlen(e->message);
+    if (ok && write_helper(fd, (char*)&kind, sizeof(size_t)) != (ssize_t)sizeof(size_t)) ok = false;
+    if (ok && write_helper(fd, (char*)&e->sender, sizeof(uint64_t)) != (ssize_t)sizeof(uint64_t)) ok = false;
+    if (ok && write_helper(fd, (char*)&e->seq, sizeof(uint64_t)) != (ssize_t)sizeof(uint64_t)) ok = false;
+    if (ok && write_helper(fd, (char*)&milen, sizeof(size_t)) != (ssize_t)sizeof(size_t)) ok = false;
+    if (ok && write_helper(fd, e->message_id, milen) != (ssize_t)milen) ok = false;
+    if (ok && write_helper(fd, (char*)&ulen, sizeof(size_t)) != (ssize_t)sizeof(size_t)) ok = false;
+    if (ok && write_helper(fd, e->username, ulen) != (ssize_t)ulen) ok = false;
+    if (ok && write_helper(fd, (char*)&mlen, sizeof(size_t)) != (ssize_t)sizeof(size_t)) ok = false;
+    if (ok && write_helper(fd, e->message, mlen) != (ssize_t)mlen) ok = false;
+    if (ok) capture_frame(CAPTURE_OUT, fd, NULL, e->message_id, e->username, e->message);
+    free(e->message_id);
+    free(e->username);
+    free(e->message);
+  }
+  transport_cork(fd, false);
+  if (!ok) remove_peer(fd);
+  pthread_mutex_unlock(&peers_lock);
+
+  if (!ok) rooms_advertise();
+  return 0;
+}
+
+void multicast_repaired(uint64_t sender, uint64_t seq, const char* username, const char* message,
+                        const char* message_id) {
+  bool gap;
+  pthread_mutex_lock(&mcast_lock);
+  if (note_seq(sender, seq, true, &gap)) {
+    cache_add(sender, seq, message_id, username, message);
+  }
+  pthread_mutex_unlock(&mcast_lock);
+}
@@ -0,0 +1,94 @@
+#if !defined(MULTICAST_H)
+#define MULTICAST_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Optional LAN fan-out through UDP multicast.
+ *
+ * Every node on the segment joins the same group. A node sends each message it
+ * originates once to the group instead of once per TCP peer, tagged with its
+ * node id and a per-node sequence number. Receivers notice gaps in a sender's
+ * sequence and ask their TCP neighbors to repair them with a FRAME_NACK; any
+ * neighbor that still caches the message answers with a FRAME_REPAIR. Repaired
+ * and multicast messages go through the same seen[] check as everything else.
+ *
+ * Nodes outside the group, or in the same group on another segment (the TTL is
+ * 1), still reach us over TCP. When a link is added, a node in a group sends
+ * the peer a FRAME_GROUP with the group and its node id:
+ *
+ *   size_t kind      FRAME_GROUP
+ *   uint64_t group   The group address and port
+ *   uint64_t node    The sender's node id
+ *
+ * A neighbor counts as a group member once it named our group and we have
+ * also heard its datagrams, which it sends at least once per heartbeat.
+ * Multicast and repaired messages are forwarded over TCP to every other
+ * neighbor, and flood on from there like any other message. Messages that
+ * arrive over TCP otherwise are flooded exactly as before.
+ */
+
+/**
+ * Join a multicast group and start the thread that receives from it.
+ *
+ * \param spec  The group as "<address>:<port>", e.g. "239.255.42.99:4299".
+ * \param seen  The array of processed message ids shared with the TCP path.
+ *
+ * \returns     0 on success, or -1 with errno set if the group could not be
+ *              joined.
+ */
+int multicast_open(const char* spec, char** seen);
+
+/**
+ * Check whether this node sends its messages through a multicast group.
+ */
+bool multicast_enabled();
+
+/**
+ * Send a message originated by this node to the multicast group.
+ *
+ * \returns   0 on success, or -1 if the datagram could not be sent. The message
+ *            is cached either way, so peers can still repair it.
+ */
+int multicast_send(const char* username, const char* message, const char* message_id);
+
+/**
+ * Tell a newly added peer which group we are in, if any. Called with
+ * peers_lock held.
+ */
+void multicast_peer_added(int fd);
+
+/**
+ * Record the group and node id a peer sent in a FRAME_GROUP.
+ */
+void multicast_peer_group(int fd, uint64_t group, uint64_t node);
+
+/**
+ * Check whether a peer is in our multicast group and its datagrams reach us,
+ * so it receives our group's messages without TCP. Called with peers_lock
+ * held.
+ */
+bool multicast_is_member(int fd);
+
+/**
+ * Forget a removed peer. Called with peers_lock held.
+ */
+void multicast_peer_removed(int fd);
+
+/**
+ * Handle a FRAME_NACK read from a peer: read the rest of the frame and answer
+ * every sequence number still in our cache with a FRAME_REPAIR on the same fd.
+ *
+ * \returns   0 on success, or -1 if the frame could not be read.
+ */
+int multicast_handle_nack(int fd);
+
+/**
+ * Record a message that a peer repaired for us, so it is no longer requested
+ * and can in turn be repaired for others.
+ */
+void multicast_repaired(uint64_t sender, uint64_t seq, const char* username, const char* message,
+                        const char* message_id);
+
+#endif
@@ -10,9 +10,14 @@
 #include "writing.h"
 #include "ui.h"
 #include "reading.h"
-
-#define CAPACITY 1000
-#define MESSAGE_LEN 2048
+#include "local.h"
+#include "multicast.h"
+#include "rooms.h"
+#include "capture.h"
+#include "history.h"
+#include "batch.h"
+#include "transport.h"
+#include "p2pchat.h"
 
 pthread_mutex_t peers_lock = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t seen_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -28,35 +33,81 @@ char* seen[CAPACITY];
 intptr_t peers[CAPACITY];
 int num_peers = 0;
 
-// Function to forwards a message from the local user to all other connected peers
-void broadcast(const char* username, const char* message, const char* message_id) {
+// Remove a peer whose link failed. Must hold peers_lock
+void remove_peer(intptr_t fd) {
+    int i = 0;
+    while (i < num_peers && peers[i] != fd) i++;
+    if (i == num_peers) return;
+
+    rooms_peer_removed(fd);
+    multicast_peer_removed(fd);
+    batch_peer_removed(fd);
+    transport_peer_removed(fd);
+    local_close(fd);
+
+    // shift left
+    for (int j = i; j < num_peers - 1; ++j) {
+        peers[j] = peers[j + 1];
+    }
+    num_peers--;
+}
+
+// Forward a message to connected peers, leaving out members of our multicast
+// group if outside_group is set
+static void forward(const char* username, const char* message, const char* message_id, const char* room,
+                    bool outside_group) {
     size_t ulen = strlen(username);
     size_t mlen = strlen(message);
     size_t milen = strlen(message_id);
+    size_t rlen = room != NULL ? strlen(room) : 0;
+    size_t kind = FRAME_ROOM;
+    bool removed = false;
+
+    // Lay the whole frame out once, so each peer gets it in a single write or
+    // as part of a batch
+    size_t len = (room != NULL ? 2 * sizeof(size_t) + rlen : 0) + 3 * sizeof(size_t) + milen + ulen + mlen;
+    char* frame = malloc(len);
+    char* pos = frame;
+    if (room != NULL) {
+        memcpy(pos, &kind, sizeof(size_t));
+        pos += sizeof(size_t);
+        memcpy(pos, &rlen, sizeof(size_t));
+        pos += sizeof(size_t);
+        memcpy(pos, room, rlen);
+        pos += rlen;
+    }
+    memcpy(pos, &milen, sizeof(size_t));
+    pos += sizeof(size_t);
+    memcpy(pos, message_id, milen);
+    pos += milen;
+    memcpy(pos, &ulen, sizeof(size_t));
+    pos += sizeof(size_t);
+    memcpy(pos, username, ulen);
+    pos += ulen;
+    memcpy(pos, &mlen, sizeof(size_t));
+    pos += sizeof(size_t);
+    memcpy(pos, message, mlen);
 
     pthread_mutex_lock(&peers_lock);
 
     for (int i = 0; i < num_peers; ++i) {
         intptr_t fd = peers[i];
 
-        // Send all fields. If any send fails, treat that peer as disconnected
-        bool ok = true;
-        if (write_helper(fd, (char*)&milen, sizeof(size_t)) != (ssize_t)sizeof(size_t)) ok = false;
-        if (ok && write_helper(fd, message_id, milen) != (ssize_t)milen) ok = false;
-        if (ok && write_helper(fd, (char*)&ulen, sizeof(size_t)) != (ssize_t)sizeof(size_t)) ok = false;
-        if (ok && write_helper(fd, username, ulen) != (ssize_t)ulen) ok = false;
-        if (ok && write_helper(fd, (char*)&mlen, sizeof(size_t)) != (ssize_t)sizeof(size_t)) ok = false;
-        if (ok && write_helper(fd, message, mlen) != (ssize_t)mlen) ok = false;
+        // Skip links where nobody downstream joined the room
+        if (room != NULL && !rooms_wants(fd, room)) continue;
 
-        if (!ok) {
-            // Peer disconnected or had an error. Remove it from list
-            close(fd);
+        // Skip links that already got the message from the multicast group
+        if (outside_group && multicast_is_member(fd)) continue;
 
-            // shift left
-            for (int j = i; j < num_peers - 1; ++j) {
-                peers[j] = peers[j + 1];
-            }
-            num_peers--;
+        // Send the frame. If it fails, treat that peer as disconnected
+        bool ok = batch_write(fd, frame, len) == 0;
+
+        if (ok) {
+            capture_frame(CAPTURE_OUT, fd, room, message_id, username, message);
+        } else {
+            // Peer disconnected or had an error. Remove it from list
+            remove_peer(fd);
+            removed = true;
 
             // we've moved a new peer into index i; process this index again
             i--;
@@ -65,8 +116,56 @@ void broadcast(const char* username, const char* message, const char* message_id
     }
 
     pthread_mutex_unlock(&peers_lock);
+    free(frame);
+
+    // The rooms behind the removed peers are no longer reachable through us
+    if (removed) rooms_advertise();
 }
 
+// Function to forwards a message from the local user to all other connected peers
+void broadcast(const char* username, const char* message, const char* message_id, const char* room) {
+    forward(username, message, message_id, room, false);
+}
+
+void broadcast_outside_group(const char* username, const char* message, const char* message_id) {
+    forward(username, message, message_id, NULL, true);
+}
+
+
+// Add a connected peer to the global peer list and start its reading thread
+void add_peer(intptr_t peer_fd)
+{
+  // Add new peers to the global peer list
+  pthread_mutex_lock(&peers_lock);
+  if (num_peers < CAPACITY)
+  {
+    // store peers
+    peers[num_peers++] = peer_fd;
+    capture_peer_added(peer_fd);
+    transport_peer_added(peer_fd);
+    multicast_peer_added(peer_fd);
+  }
+  else
+  {
+    // too many peers
+    pthread_mutex_unlock(&peers_lock);
+    local_close(peer_fd);
+    local_detach(peer_fd);
+    return;
+  }
+  pthread_mutex_unlock(&peers_lock);
+
+  // tell the new peer which rooms can be reached through us
+  rooms_advertise();
+
+  // create a read thread for each peer
+  pthread_t t;
+  // create struct peer to pass in args
+  peer* p = malloc(sizeof(*p));
+  p->peer_fd = peer_fd;
+  p->seen = seen;
+  pthread_create(&t, NULL, peer_read_thread, (void*) p);
+}
 
 // Thread for accepting incoming connection thread
 void *accept_thread(void *arg)
@@ -81,29 +180,7 @@ void *accept_thread(void *arg)
     if (peer_fd < 0)
       continue;
 
-    // Add new peers to the global peer list
-    pthread_mutex_lock(&peers_lock);
-    if (num_peers < CAPACITY)
-    {
-      // store peers
-      peers[num_peers++] = peer_fd;
-    }
-    else
-    {
-      // too many peers
-      close(peer_fd);
-      pthread_mutex_unlock(&peers_lock);
-      continue;
-    }
-    pthread_mutex_unlock(&peers_lock);
-
-    // create a read thread for each peer
-    pthread_t t;
-    // create struct peer to pass in args
-    peer* p = malloc(sizeof(*p));
-    p->peer_fd = peer_fd;
-    p->seen = seen;
-    pthread_create(&t, NULL, peer_read_thread, (void*) p);
+    add_peer(peer_fd);
   }
   return NULL;
 }
@@ -117,8 +194,45 @@ void input_callback(const char *message)
     return;   // do not broadcast anything or modify seen
   }
 
+  // join a room and send new messages to it
+  if (strncmp(message, ":join ", 6) == 0)
+  {
+    if (!rooms_join(message + 6)) ui_display("INFO", "Could not join that room.");
+    return;
+  }
+
+  // leave a room
+  if (strncmp(message, ":leave ", 7) == 0)
+  {
+    if (!rooms_leave(message + 7)) ui_display("INFO", "You are not in that room.");
+    return;
+  }
+
+  // show how each peer link is set up
+  if (strcmp(message, ":peers") == 0)
+  {
+    transport_report();
+    return;
+  }
+
+  // search the history
+  if (strncmp(message, ":search ", 8) == 0)
+  {
+    history_search(message + 8);
+    return;
+  }
+
+  // show what a user has said
+  if (strncmp(message, ":from ", 6) == 0)
+  {
+    history_from(message + 6);
+    return;
+  }
+
   // display locally
-  ui_display(username, message);
+  char current[ROOM_LEN + 1];
+  const char* room = rooms_current(current) ? current : NULL;
+  rooms_display(room, username, message);
 
   // create message id
   count++;
@@ -127,17 +241,17 @@ void input_callback(const char *message)
   snprintf(message_id, sizeof(message_id), "%s%d", username, count);
 
   // add to our own seen set
-  pthread_mutex_lock(&seen_lock);
-  for (int i=0; i<CAPACITY; i++){
-    if (seen[i] == NULL) {
-      seen[i] = strdup(message_id);
-      break;
-    }
+  seen_add(seen, message_id);
+
+  // Send the message once to the LAN multicast group if we joined one, and
+  // over TCP to the neighbors outside the group. If the datagram could not be
+  // sent, every peer gets the message over TCP instead. Room messages are
+  // always routed by interest over TCP
+  if (room == NULL && multicast_enabled() && multicast_send(username, message, message_id) == 0) {
+    broadcast_outside_group(username, message, message_id);
+  } else {
+    broadcast(username, message, message_id, room);
   }
-  pthread_mutex_unlock(&seen_lock);
-
-  // Broadcast the message
-  broadcast(username, message, message_id);
 }
 
 // Function to free all strdup'ed strings in seen[]
@@ -184,6 +298,45 @@ int main(int argc, char **argv)
   exit(EXIT_FAILURE);
 }
 
+  // record every frame to a file if asked, e.g. P2PCHAT_CAPTURE=node.cap
+  char* capture_path = getenv("P2PCHAT_CAPTURE");
+  if (capture_path != NULL && capture_open(capture_path) == -1) {
+    perror("Capture file was not created");
+    exit(EXIT_FAILURE);
+  }
+
+  // join the LAN multicast group if one was configured, e.g.
+  // P2PCHAT_MULTICAST=239.255.42.99:4299 (append @127.0.0.1 to test on loopback)
+  char* multicast_spec = getenv("P2PCHAT_MULTICAST");
+  if (multicast_spec != NULL && multicast_open(multicast_spec, seen) == -1) {
+    perror("Multicast group was not joined");
+    exit(EXIT_FAILURE);
+  }
+
+  // pick how peer sockets are set up, e.g. P2PCHAT_PROFILE=latency
+  char* profile = getenv("P2PCHAT_PROFILE");
+  if (profile != NULL && transport_open(profile) == -1) {
+    perror("Transport profile was not selected");
+    exit(EXIT_FAILURE);
+  }
+
+  // keep a searchable history on disk, e.g. P2PCHAT_HISTORY=~/.p2pchat
+  char* history_dir = getenv("P2PCHAT_HISTORY");
+  if (history_dir != NULL && history_open(history_dir) == -1) {
+    perror("History was not opened");
+    exit(EXIT_FAILURE);
+  }
+
+  // coalesce frames on busy links
+  if (batch_start() == -1) {
+    perror("Batch thread was not started");
+    exit(EXIT_FAILURE);
+  }
+
+  // accept connections from peers on this host through shared memory. If that
+  // is not available they will simply connect over TCP instead.
+  local_listen(port);
+
   // create thread to wait for connections
   pthread_t thread_id;
   pthread_create(&thread_id, NULL, accept_thread, (void *)server_socket_fd);
@@ -195,32 +348,31 @@ int main(int argc, char **argv)
     char *peer_hostname = argv[2];
     unsigned short peer_port = atoi(argv[3]);
 
-    // Connect to another peer in the chat network
-    intptr_t peer_fd;
-    if ((peer_fd = socket_connect(peer_hostname, peer_port)) == -1)
+    // Connect to another peer in the chat network. Peers on this host are
+    // reached through shared memory; everyone else, or a peer that does not
+    // answer locally, is reached over TCP.
+    intptr_t peer_fd = -1;
+    if (local_is_same_host(peer_hostname))
+    {
+      peer_fd = local_connect(peer_port);
+    }
+    if (peer_fd == -1 && (peer_fd = socket_connect(peer_hostname, peer_port)) == -1)
     {
       perror("Connection fail");
       exit(EXIT_FAILURE);
     }
 
-    // add to peer list
-    pthread_mutex_lock(&peers_lock); // lock when altering shared array
-    peers[num_peers++] = peer_fd;
-    pthread_mutex_unlock(&peers_lock); 
-
-    // Call reading thread
-    pthread_t t;
-    // Create peer struct
-    peer* p = malloc(sizeof(*p));
-    p->peer_fd = peer_fd;
-    p->seen = seen;
-    pthread_create(&t, NULL, peer_read_thread, (void*)p);
+    // add to peer list and start reading from it
+    add_peer(peer_fd);
   }
 
   // Set up the user interface. The input_callback function will be called
   // each time the user hits enter to send a message.
   ui_init(input_callback);
 
+  // Scroll back through the history instead of only what is in memory
+  if (history_enabled()) ui_set_pager(history_page, history_count);
+
   // Once the UI is running, you can use it to display log messages
   ui_display("INFO", "This is a handy log message.");
 
@@ -233,6 +385,8 @@ int main(int argc, char **argv)
   ui_run();
 
   // Free before program exits:
+  history_close();
+  capture_close();
   free_seen(seen);
   return 0;
 }
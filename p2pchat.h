@@ -1,9 +1,38 @@
 #if !defined(P2PCHAT_H)
 #define P2PCHAT_H
 
+#include <stdint.h>
 #include <sys/socket.h>
 
-// Helper function to write all the required bytes
-void broadcast(const char* username, const char* message, const char* message_id);
+// Most peers, and most message ids remembered as seen
+#define CAPACITY 1000
+
+// Longest message id, username or message accepted from a peer
+#define MESSAGE_LEN 2048
+
+// Every frame starts with the length of its message id. Lengths this large are
+// never valid, so they mark other kinds of frames instead.
+#define FRAME_NACK ((size_t)-1)
+#define FRAME_REPAIR ((size_t)-2)
+#define FRAME_GROUP ((size_t)-3)
+#define FRAME_INTEREST ((size_t)-4)
+#define FRAME_ROOM ((size_t)-5)
+#define FRAME_BATCH ((size_t)-6)
+
+// Send a message to every peer. Room messages (room is not NULL) only go to
+// peers with someone interested in the room behind them
+void broadcast(const char* username, const char* message, const char* message_id, const char* room);
+
+// Send a multicast group message to the peers that are not known to be in the
+// group, since the rest already received it
+void broadcast_outside_group(const char* username, const char* message, const char* message_id);
+
+// Add a connected peer to the peer list and start a thread to read from it
+void add_peer(intptr_t peer_fd);
+
+// Remove a peer whose link failed from the peer list and close it. Must hold
+// peers_lock. Call rooms_advertise() after releasing it, since the rooms
+// behind the peer are no longer reachable through us
+void remove_peer(intptr_t fd);
 
 #endif
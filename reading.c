@@ -9,14 +9,34 @@
 #include "ui.h"
 #include "p2pchat.h"
 #include "reading.h"
-
-#define MESSAGE_LEN 2048
-#define CAPACITY 1000
+#include "local.h"
+#include "multicast.h"
+#include "rooms.h"
+#include "capture.h"
+#include "sanitize.h"
+#include "batch.h"
 
 extern pthread_mutex_t seen_lock;
 
+// The frames of a batch, read in one go and handed out by read_helper before
+// anything else is read. Each reader thread unpacks its own batches
+static __thread char* batch_buf = NULL;
+static __thread size_t batch_len = 0;
+static __thread size_t batch_pos = 0;
+
 // Helper function to all the required bytes
 size_t read_helper(int fd, void* buf, size_t len) {
+  // A frame never continues past the end of its batch
+  if (batch_pos < batch_len) {
+    if (len > batch_len - batch_pos) return 0;
+    memcpy(buf, batch_buf + batch_pos, len);
+    batch_pos += len;
+    return len;
+  }
+
+  // Peers on this host are read from their shared memory ring
+  if (local_is_link(fd)) return local_read(fd, buf, len);
+
   // Bytes read so far
   size_t bytes_read = 0; 
   
@@ -24,8 +44,8 @@ size_t read_helper(int fd, void* buf, size_t len) {
   while (bytes_read < len) {
     // Try to read the entire remaining message
     ssize_t rc2 = read(fd, buf + bytes_read, len - bytes_read);
-    // Catch error
-    if (rc2 < 0) return rc2;
+    // Catch error, or the peer closing the connection
+    if (rc2 <= 0) return rc2;
     // Update bytes read so far
     bytes_read += rc2;
   }
@@ -34,6 +54,84 @@ size_t read_helper(int fd, void* buf, size_t len) {
   return bytes_read;
 }
 
+// Slot of the oldest message id once seen[] is full. Protected by seen_lock
+static int seen_oldest = 0;
+
+// Check whether a message id has been processed, and record it if not
+bool seen_add(char** seen, const char* message_id) {
+  pthread_mutex_lock(&seen_lock);
+
+  // Check if in set
+  int i = 0;
+  while (i < CAPACITY && seen[i] != NULL) {
+    if (strcmp(seen[i], message_id) == 0) {
+      pthread_mutex_unlock(&seen_lock);
+      return false;
+    }
+    i++;
+  }
+
+  // store message id in the first free slot. Once every slot is used, replace
+  // the oldest id, so new messages are still recorded and not forwarded again
+  // and again when they come back to us
+  if (i == CAPACITY) {
+    i = seen_oldest;
+    free(seen[i]);
+    seen_oldest = (seen_oldest + 1) % CAPACITY;
+  }
+  seen[i] = strdup(message_id);
+
+  pthread_mutex_unlock(&seen_lock);
+  return true;
+}
+
+// Read one length-prefixed field. Returns NULL if it is too long or cut off.
+static char* read_field(int fd, size_t len) {
+  // Check if size is appropriate
+  if (len > MESSAGE_LEN) return NULL;
+
+  char* field = malloc(len + 1);
+  field[len] = '\0';
+  if (read_helper(fd, field, len) != len) {
+    free(field);
+    return NULL;
+  }
+  return field;
+}
+
+// Read the rest of a frame once the message id length has been read
+int read_fields(int fd, size_t milen, char** message_id, char** username, char** message) {
+  *message_id = NULL;
+  *username = NULL;
+  *message = NULL;
+
+  // Read the message_id
+  if ((*message_id = read_field(fd, milen)) == NULL) return -1;
+
+  // Reading the username's length and the username
+  size_t username_len;
+  if (read_helper(fd, &username_len, sizeof(size_t)) != sizeof(size_t)) goto fail;
+  if ((*username = read_field(fd, username_len)) == NULL) goto fail;
+
+  // Get message length and the full message
+  size_t message_len;
+  if (read_helper(fd, &message_len, sizeof(size_t)) != sizeof(size_t)) goto fail;
+  if ((*message = read_field(fd, message_len)) == NULL) goto fail;
+
+  // Both end up on the terminal, so strip control characters and bad UTF-8
+  sanitize_text(*username, username_len);
+  sanitize_text(*message, message_len);
+
+  return 0;
+
+fail:
+  free(*message_id);
+  free(*username);
+  *message_id = NULL;
+  *username = NULL;
+  return -1;
+}
+
 // Thread to read both username and message. Recieve lengths first and then contents
 void* peer_read_thread(void* arg) {
   peer* p = (peer*) arg;
@@ -43,80 +141,112 @@ void* peer_read_thread(void* arg) {
   // Keep reading information from this peer
   while(1) {
 
-    // Read the message id
+    // Read the message id length, or the kind of a control frame
+    bool in_batch = batch_pos < batch_len;
     size_t milen;
-    if (read(peer_fd, &milen, sizeof(size_t)) != sizeof(size_t)) {
+    if (read_helper(peer_fd, &milen, sizeof(size_t)) != sizeof(size_t)) {
       break; // Stop reading if there's an error
     }
-    // Allocate memory for the message id
-    char *message_id = malloc(milen+1);
-    message_id[milen] = '\0';
-
-    // Read the message_id
-    read_helper(peer_fd, message_id, milen);
-
-    // Flag for if i should display/broadcast
-    int flag = 1;
-    // Check if in set
-    int i = 0;
-    while (seen[i] != NULL){
-      if (strcmp(seen[i], message_id) == 0) {
-        flag = 0;
+
+    // Several frames from a busy link. Read them all at once; the frames are
+    // then handled one by one below as if they had arrived on their own
+    if (milen == FRAME_BATCH) {
+      size_t len;
+      if (in_batch || read_helper(peer_fd, &len, sizeof(size_t)) != sizeof(size_t)) break;
+      if (len > BATCH_MAX_BYTES) break;
+      if (batch_buf == NULL && (batch_buf = malloc(BATCH_MAX_BYTES)) == NULL) break;
+      if (read_helper(peer_fd, batch_buf, len) != len) break;
+      batch_len = len;
+      batch_pos = 0;
+      continue;
+    }
+
+    // A neighbor is missing multicast messages it thinks we have
+    if (milen == FRAME_NACK) {
+      if (multicast_handle_nack(peer_fd)) break;
+      continue;
+    }
+
+    // A neighbor telling us which multicast group it is in
+    if (milen == FRAME_GROUP) {
+      uint64_t group;
+      uint64_t node;
+      if (read_helper(peer_fd, &group, sizeof(uint64_t)) != sizeof(uint64_t)) break;
+      if (read_helper(peer_fd, &node, sizeof(uint64_t)) != sizeof(uint64_t)) break;
+      multicast_peer_group(peer_fd, group, node);
+      continue;
+    }
+
+    // A neighbor's summary of the rooms reachable through it
+    if (milen == FRAME_INTEREST) {
+      unsigned char filter[ROOMS_FILTER_BYTES];
+      if (read_helper(peer_fd, filter, ROOMS_FILTER_BYTES) != ROOMS_FILTER_BYTES) break;
+      rooms_update(peer_fd, filter);
+      continue;
+    }
+
+    // A room message carries the room ahead of the usual fields
+    char* room = NULL;
+    if (milen == FRAME_ROOM) {
+      size_t room_len;
+      if (read_helper(peer_fd, &room_len, sizeof(size_t)) != sizeof(size_t)) break;
+      if (room_len > ROOM_LEN || (room = read_field(peer_fd, room_len)) == NULL) break;
+      sanitize_text(room, room_len);
+      if (read_helper(peer_fd, &milen, sizeof(size_t)) != sizeof(size_t)) {
+        free(room);
         break;
       }
-      i++;
     }
 
-    // Reading the username's length 
-    size_t username_len;
-    if (read(peer_fd, &username_len, sizeof(size_t)) != sizeof(size_t)) {
+    // A multicast message repaired for us. It carries the sender and sequence
+    // number ahead of the usual fields
+    bool repair = false;
+    uint64_t sender = 0;
+    uint64_t seq = 0;
+    if (milen == FRAME_REPAIR) {
+      if (read_helper(peer_fd, &sender, sizeof(uint64_t)) != sizeof(uint64_t)) break;
+      if (read_helper(peer_fd, &seq, sizeof(uint64_t)) != sizeof(uint64_t)) break;
+      if (read_helper(peer_fd, &milen, sizeof(size_t)) != sizeof(size_t)) break;
+      repair = true;
+    }
+
+    char* message_id;
+    char* username;
+    char* message;
+    if (read_fields(peer_fd, milen, &message_id, &username, &message)) {
+      free(room);
       break; // Stop reading if there's an error
     }
 
-    // Check if size is appropriate 
-    if (username_len > MESSAGE_LEN) break;
-
-    // Allocate memory for the username
-    char *username = malloc(username_len+1);
-    username[username_len] = '\0';
-
-    // Read the username
-    read_helper(peer_fd, username, username_len);
-
-    // Get message length
-    size_t message_len;
-    read(peer_fd, &message_len, sizeof(size_t));
-
-    // Check size
-    if (message_len > MESSAGE_LEN) break;
-    char *message = malloc(message_len+1);
-    message[message_len] = '\0';
-
-    // Read the full message
-    read_helper(peer_fd, message, message_len);
-    
-    // check flag
-    if (flag) {
-      ui_display(username, message);
-      /* Broadcast to all other peers */
-      broadcast(username, message, message_id);
-
-      // store message id
-      // find a free slot and store
-      pthread_mutex_lock(&seen_lock);
-      for (int i = 0; i < CAPACITY; i++) {
-          if (seen[i] == NULL) {
-              seen[i] = strdup(message_id);  
-              break;
-          }
+    capture_frame(CAPTURE_IN, peer_fd, room, message_id, username, message);
+
+    if (repair) multicast_repaired(sender, seq, username, message, message_id);
+
+    // Display and forward messages we have not processed yet. The rest of the
+    // multicast group repairs its own losses, so repaired messages only go to
+    // neighbors outside the group. Room messages are only displayed if we
+    // joined the room, but are still forwarded towards anyone else who did
+    if (seen_add(seen, message_id)) {
+      if (room == NULL || rooms_joined(room)) rooms_display(room, username, message);
+      if (repair) {
+        broadcast_outside_group(username, message, message_id);
+      } else {
+        broadcast(username, message, message_id, room);
       }
-      pthread_mutex_unlock(&seen_lock);
     }
 
+    free(room);
     free(username);
     free(message);
     free(message_id);
   }
+  free(batch_buf);
+  batch_buf = NULL;
+  batch_len = 0;
+  batch_pos = 0;
+
+  // Let a local link release its shared memory once the peer is closed
+  local_detach(peer_fd);
   free(p);
   return NULL;
-}
\ No newline at end of file
+}
@@ -1,11 +1,22 @@
 #if !defined(READING_H)
 #define READING_H
 
+#include <stdbool.h>
+#include <stdint.h>
 #include <sys/socket.h>
 
 // Helper function to read all the required bytes
 size_t read_helper(int fd, void* buf, size_t len);
 
+// Check whether a message id is in seen, adding it if not. Returns true for a
+// message that has not been processed yet
+bool seen_add(char** seen, const char* message_id);
+
+// Read the username and message fields of a frame whose message id length has
+// already been read. Returns 0 on success, or -1 if the frame is cut off or a
+// field is too long. The caller frees all three strings
+int read_fields(int fd, size_t milen, char** message_id, char** username, char** message);
+
 // Thread to read both username and message. Receive lengths first and then contents
 void* peer_read_thread(void* arg);
 
@@ -0,0 +1,417 @@
+// Replay a capture recorded with P2PCHAT_CAPTURE into a running node.
+//
+// The tool connects to a node as an ordinary peer and sends it every distinct
+// message in the capture, keeping the original spacing divided by a speed
+// factor, or as fast as possible. It asks for every room's traffic and reads
+// the frames that come back. Each message is stamped when it is sent and when
+// it is first seen again. To measure a loopback mesh, give a second node and
+// messages are timed from when they are sent to the first node until they
+// reach the second.
+
+#include <errno.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "p2pchat.h"
+#include "rooms.h"
+#include "socket.h"
+#include "util.h"
+
+// How long to wait for stragglers once every message has been sent
+#define REPLAY_DRAIN_MS 2000
+
+// One message from the capture
+typedef struct {
+  uint64_t time_ns;
+  char* room;
+  char* username;
+  char* message;
+} replay_message;
+
+static replay_message* messages;
+static size_t num_messages = 0;
+
+// Send and first-arrival times, indexed like messages
+static uint64_t* send_ns;
+static uint64_t* recv_ns;
+
+// Protects received and last_progress_ns
+static pthread_mutex_t replay_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t received = 0;
+static uint64_t last_progress_ns = 0;
+
+// Prefix of the message ids we send, so the node does not drop them as seen
+static char id_prefix[64];
+
+// Read exactly len bytes, or return -1
+static int read_all(int fd, void* buf, size_t len) {
+  size_t bytes_read = 0;
+  while (bytes_read < len) {
+    ssize_t rc = read(fd, (char*)buf + bytes_read, len - bytes_read);
+    if (rc <= 0) return -1;
+    bytes_read += rc;
+  }
+  return 0;
+}
+
+// Write all len bytes, or return -1
+static int write_all(int fd, const void* buf, size_t len) {
+  size_t bytes_written = 0;
+  while (bytes_written < len) {
+    ssize_t rc = write(fd, (const char*)buf + bytes_written, len - bytes_written);
+    if (rc < 0) return -1;
+    bytes_written += rc;
+  }
+  return 0;
+}
+
+// Read a field of a capture record into a new string
+static char* read_capture_field(FILE* f, uint16_t len) {
+  char* field = malloc(len + 1);
+  if (fread(field, 1, len, f) != len) {
+    free(field);
+    return NULL;
+  }
+  field[len] = '\0';
+  return field;
+}
+
+// Hash set of message ids, so a message captured going both in and out is
+// only replayed once
+static char** ids;
+static size_t ids_size = 0;
+
+static bool id_add(const char* id) {
+  uint64_t hash = hash_bytes(id, strlen(id));
+  for (size_t i = hash & (ids_size - 1);; i = (i + 1) & (ids_size - 1)) {
+    if (ids[i] == NULL) {
+      ids[i] = strdup(id);
+      return true;
+    }
+    if (strcmp(ids[i], id) == 0) return false;
+  }
+}
+
+// Load every distinct message in a capture, in the order they were recorded
+static int load_capture(const char* path) {
+  FILE* f = fopen(path, "rb");
+  if (f == NULL) return -1;
+
+  char magic[CAPTURE_MAGIC_LEN];
+  if (fread(magic, 1, CAPTURE_MAGIC_LEN, f) != CAPTURE_MAGIC_LEN || memcmp(magic, CAPTURE_MAGIC, CAPTURE_MAGIC_LEN)) {
+    fclose(f);
+    errno = EINVAL;
+    return -1;
+  }
+
+  size_t capacity = 1024;
+  messages = malloc(capacity * sizeof(replay_message));
+  ids_size = 2 * capacity;
+  ids = calloc(ids_size, sizeof(char*));
+
+  char header[CAPTURE_HEADER_LEN];
+  while (fread(header, 1, CAPTURE_HEADER_LEN, f) == CAPTURE_HEADER_LEN) {
+    uint64_t time_ns;
+    uint8_t type;
+    uint16_t lens[4];
+    memcpy(&time_ns, header, 8);
+    memcpy(&type, header + 8, 1);
+    memcpy(lens, header + 13, sizeof(lens));
+
+    char* fields[4];
+    bool ok = true;
+    for (int i = 0; i < 4; i++) {
+      fields[i] = ok ? read_capture_field(f, lens[i]) : NULL;
+      if (fields[i] == NULL) ok = false;
+    }
+
+    bool keep = ok && type != CAPTURE_PEER && id_add(fields[1]);
+    if (keep) {
+      // Grow the message list, and rebuild the id set so it stays half empty
+      if (num_messages == capacity) {
+        capacity *= 2;
+        messages = realloc(messages, capacity * sizeof(replay_message));
+        char** old_ids = ids;
+        size_t old_size = ids_size;
+        ids_size = 2 * capacity;
+        ids = calloc(ids_size, sizeof(char*));
+        for (size_t i = 0; i < old_size; i++) {
+          if (old_ids[i] != NULL) {
+            id_add(old_ids[i]);
+            free(old_ids[i]);
+          }
+        }
+        free(old_ids);
+      }
+
+      messages[num_messages++] = (replay_message){
+          .time_ns = time_ns,
+          .room = lens[0] > 0 ? fields[0] : NULL,
+          .username = fields[2],
+          .message = fields[3],
+      };
+      if (lens[0] == 0) free(fields[0]);
+      free(fields[1]);
+    } else {
+      for (int i = 0; i < 4; i++) free(fields[i]);
+    }
+
+    if (!ok) break;
+  }
+
+  fclose(f);
+  return 0;
+}
+
+// Send one message as a frame, with a message id the node has never seen
+static int send_message(int fd, size_t index) {
+  replay_message* m = &messages[index];
+  char message_id[96];
+  snprintf(message_id, sizeof(message_id), "%s%zu", id_prefix, index);
+
+  size_t rlen = m->room != NULL ? strlen(m->room) : 0;
+  size_t milen = strlen(message_id);
+  size_t ulen = strlen(m->username);
+  size_t mlen = strlen(m->message);
+
+  // Build the whole frame so it goes out in one write
+  char frame[5 * sizeof(size_t) + ROOM_LEN + sizeof(message_id) + 2 * MESSAGE_LEN];
+  size_t len = 0;
+  if (m->room != NULL) {
+    size_t kind = FRAME_ROOM;
+    memcpy(frame + len, &kind, sizeof(size_t));
+    len += sizeof(size_t);
+    memcpy(frame + len, &rlen, sizeof(size_t));
+    len += sizeof(size_t);
+    memcpy(frame + len, m->room, rlen);
+    len += rlen;
+  }
+  memcpy(frame + len, &milen, sizeof(size_t));
+  len += sizeof(size_t);
+  memcpy(frame + len, message_id, milen);
+  len += milen;
+  memcpy(frame + len, &ulen, sizeof(size_t));
+  len += sizeof(size_t);
+  memcpy(frame + len, m->username, ulen);
+  len += ulen;
+  memcpy(frame + len, &mlen, sizeof(size_t));
+  len += sizeof(size_t);
+  memcpy(frame + len, m->message, mlen);
+  len += mlen;
+
+  return write_all(fd, frame, len);
+}
+
+// Read a length-prefixed field into buf, which holds MESSAGE_LEN + 1 bytes
+static int read_frame_field(int fd, char* buf) {
+  size_t len;
+  if (read_all(fd, &len, sizeof(size_t)) || len > MESSAGE_LEN || read_all(fd, buf, len)) return -1;
+  buf[len] = '\0';
+  return 0;
+}
+
+// Thread that reads every frame a node sends us. Message arrivals are only
+// timed if measure is set; otherwise frames are just drained so the node is
+// never blocked writing to us
+typedef struct {
+  int fd;
+  bool measure;
+} reader_args;
+
+static void* replay_read_thread(void* arg) {
+  reader_args* args = arg;
+  char buf[MESSAGE_LEN + 1];
+
+  while (1) {
+    size_t milen;
+    if (read_all(args->fd, &milen, sizeof(size_t))) break;
+
+    // Skip control frames and the extra fields in front of a message. The
+    // frames of a batch follow its header as usual
+    if (milen == FRAME_BATCH) {
+      if (read_all(args->fd, buf, sizeof(size_t))) break;
+      continue;
+    }
+    if (milen == FRAME_INTEREST) {
+      if (read_all(args->fd, buf, ROOMS_FILTER_BYTES)) break;
+      continue;
+    }
+    if (milen == FRAME_GROUP) {
+      if (read_all(args->fd, buf, 2 * sizeof(uint64_t))) break;
+      continue;
+    }
+    if (milen == FRAME_NACK) {
+      uint64_t sender;
+      uint32_t count;
+      if (read_all(args->fd, &sender, sizeof(sender)) || read_all(args->fd, &count, sizeof(count))) break;
+      if (count * sizeof(uint64_t) > sizeof(buf) || read_all(args->fd, buf, count * sizeof(uint64_t))) break;
+      continue;
+    }
+    if (milen == FRAME_ROOM) {
+      if (read_frame_field(args->fd, buf) || read_all(args->fd, &milen, sizeof(size_t))) break;
+    }
+    if (milen == FRAME_REPAIR) {
+      if (read_all(args->fd, buf, 2 * sizeof(uint64_t)) || read_all(args->fd, &milen, sizeof(size_t))) break;
+    }
+
+    // The message id tells us which message came back
+    if (milen > MESSAGE_LEN || read_all(args->fd, buf, milen)) break;
+    buf[milen] = '\0';
+    size_t prefix_len = strlen(id_prefix);
+    bool ours = args->measure && strncmp(buf, id_prefix, prefix_len) == 0;
+    size_t index = ours ? strtoull(buf + prefix_len, NULL, 10) : 0;
+
+    if (read_frame_field(args->fd, buf) || read_frame_field(args->fd, buf)) break;
+
+    if (ours && index < num_messages) {
+      uint64_t now = now_ns();
+      pthread_mutex_lock(&replay_lock);
+      if (recv_ns[index] == 0) {
+        recv_ns[index] = now;
+        received++;
+        last_progress_ns = now;
+      }
+      pthread_mutex_unlock(&replay_lock);
+    }
+  }
+  return NULL;
+}
+
+// Connect to a node and ask it for every room's messages
+static int connect_node(char* host, char* port) {
+  int fd = socket_connect(host, atoi(port));
+  if (fd == -1) return -1;
+
+  size_t kind = FRAME_INTEREST;
+  unsigned char all_rooms[ROOMS_FILTER_BYTES];
+  memset(all_rooms, 0xff, sizeof(all_rooms));
+  if (write_all(fd, &kind, sizeof(size_t)) || write_all(fd, all_rooms, sizeof(all_rooms))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int compare_u64(const void* a, const void* b) {
+  uint64_t x = *(const uint64_t*)a;
+  uint64_t y = *(const uint64_t*)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+  signal(SIGPIPE, SIG_IGN);
+
+  if (argc != 5 && argc != 7) {
+    fprintf(stderr, "Usage: %s <capture> <speed|max> <host> <port> [<host> <port>]\n", argv[0]);
+    exit(1);
+  }
+
+  // "max" sends as fast as possible; a number divides the recorded spacing
+  bool max_speed = strcmp(argv[2], "max") == 0;
+  double speed = 0;
+  if (!max_speed) {
+    char* end;
+    speed = strtod(argv[2], &end);
+    if (end == argv[2] || *end != '\0' || !(speed > 0) || speed == HUGE_VAL) {
+      fprintf(stderr, "Speed must be positive or \"max\"\n");
+      exit(1);
+    }
+  }
+
+  if (load_capture(argv[1])) {
+    perror("Capture could not be read");
+    exit(EXIT_FAILURE);
+  }
+  if (num_messages == 0) {
+    fprintf(stderr, "The capture holds no messages\n");
+    exit(EXIT_FAILURE);
+  }
+
+  send_ns = calloc(num_messages, sizeof(uint64_t));
+  recv_ns = calloc(num_messages, sizeof(uint64_t));
+  snprintf(id_prefix, sizeof(id_prefix), "replay%d-%llu-", getpid(), (unsigned long long)now_ns());
+
+  // Connect to the node we feed, and to the node we measure if it differs
+  int send_fd = connect_node(argv[3], argv[4]);
+  int recv_fd = argc == 7 ? connect_node(argv[5], argv[6]) : send_fd;
+  if (send_fd == -1 || recv_fd == -1) {
+    perror("Connection fail");
+    exit(EXIT_FAILURE);
+  }
+
+  pthread_t t;
+  reader_args measure_args = {.fd = recv_fd, .measure = true};
+  pthread_create(&t, NULL, replay_read_thread, &measure_args);
+  reader_args drain_args = {.fd = send_fd, .measure = false};
+  if (send_fd != recv_fd) pthread_create(&t, NULL, replay_read_thread, &drain_args);
+
+  // Send every message at its scaled offset from the first one
+  uint64_t start = now_ns();
+  uint64_t payload_bytes = 0;
+  for (size_t i = 0; i < num_messages; i++) {
+    if (!max_speed) {
+      uint64_t target = start + (uint64_t)((messages[i].time_ns - messages[0].time_ns) / speed);
+      uint64_t now = now_ns();
+      if (target > now) {
+        struct timespec delay = {.tv_sec = (target - now) / 1000000000, .tv_nsec = (target - now) % 1000000000};
+        nanosleep(&delay, NULL);
+      }
+    }
+
+    send_ns[i] = now_ns();
+    if (send_message(send_fd, i)) {
+      perror("Node closed the connection");
+      exit(EXIT_FAILURE);
+    }
+    payload_bytes += strlen(messages[i].username) + strlen(messages[i].message);
+  }
+  uint64_t send_done = now_ns();
+
+  // Wait until everything came back, or nothing has for a while
+  pthread_mutex_lock(&replay_lock);
+  last_progress_ns = send_done;
+  pthread_mutex_unlock(&replay_lock);
+  while (1) {
+    usleep(10000);
+    pthread_mutex_lock(&replay_lock);
+    bool done = received == num_messages || now_ns() - last_progress_ns > REPLAY_DRAIN_MS * 1000000ULL;
+    pthread_mutex_unlock(&replay_lock);
+    if (done) break;
+  }
+
+  // Collect the latency of every message that came back
+  pthread_mutex_lock(&replay_lock);
+  uint64_t* latencies = malloc(num_messages * sizeof(uint64_t));
+  size_t num_latencies = 0;
+  uint64_t last_recv = start;
+  for (size_t i = 0; i < num_messages; i++) {
+    if (recv_ns[i] == 0) continue;
+    latencies[num_latencies++] = recv_ns[i] - send_ns[i];
+    if (recv_ns[i] > last_recv) last_recv = recv_ns[i];
+  }
+  pthread_mutex_unlock(&replay_lock);
+  qsort(latencies, num_latencies, sizeof(uint64_t), compare_u64);
+
+  double send_s = (send_done - start) / 1e9;
+  double total_s = (last_recv - start) / 1e9;
+  printf("messages sent      %zu in %.3f s (%.0f msg/s)\n", num_messages, send_s,
+         send_s > 0 ? num_messages / send_s : 0);
+  printf("messages received  %zu (%zu lost)\n", num_latencies, num_messages - num_latencies);
+  if (num_latencies == 0) return 1;
+
+  printf("throughput         %.0f msg/s, %.3f MB/s of usernames and messages\n", num_latencies / total_s,
+         payload_bytes / total_s / 1e6);
+  printf("latency (us)       min %.1f  p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n", latencies[0] / 1e3,
+         latencies[num_latencies / 2] / 1e3, latencies[num_latencies * 9 / 10] / 1e3,
+         latencies[num_latencies * 99 / 100] / 1e3, latencies[num_latencies - 1] / 1e3);
+  return 0;
+}
@@ -0,0 +1,238 @@
+#include "rooms.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "batch.h"
+#include "history.h"
+#include "p2pchat.h"
+#include "transport.h"
+#include "ui.h"
+#include "util.h"
+#include "writing.h"
+
+// Number of rooms a node can join at once
+#define ROOMS_MAX 64
+
+// Number of bits set in the filter for each room
+#define ROOMS_HASHES 4
+
+extern pthread_mutex_t peers_lock;
+extern intptr_t peers[];
+extern int num_peers;
+
+// What we know about the interest behind one peer link
+typedef struct {
+  int fd;
+  unsigned char received[ROOMS_FILTER_BYTES];    // Advertised to us by the peer
+  unsigned char advertised[ROOMS_FILTER_BYTES];  // Last summary we sent the peer
+} room_link;
+
+// Protects everything below
+static pthread_mutex_t rooms_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Rooms this node joined, most recent last
+static char* joined[ROOMS_MAX];
+static int num_joined = 0;
+
+// Filter of the rooms in joined[]
+static unsigned char own_filter[ROOMS_FILTER_BYTES];
+
+static link_table links;
+
+// Set the bits for a room in a filter, or check whether they are all set
+static bool filter_room(unsigned char* filter, const char* room, bool set) {
+  // Split the hash into two halves for double hashing
+  uint64_t hash = hash_bytes(room, strlen(room));
+  uint32_t h1 = hash;
+  uint32_t h2 = hash >> 32;
+
+  for (int i = 0; i < ROOMS_HASHES; i++) {
+    uint32_t bit = (h1 + i * h2) % (ROOMS_FILTER_BYTES * 8);
+    if (set) {
+      filter[bit / 8] |= 1 << (bit % 8);
+    } else if (!(filter[bit / 8] & (1 << (bit % 8)))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Find the interest entry for a peer, creating it if needed. Must hold rooms_lock.
+static room_link* find_link(int fd) {
+  room_link* l = link_get(links, fd);
+  if (l != NULL) return l;
+
+  l = calloc(1, sizeof(*l));
+  if (l == NULL) return NULL;
+  l->fd = fd;
+  if (!link_set(links, fd, l)) {
+    free(l);
+    return NULL;
+  }
+  return l;
+}
+
+// Rebuild own_filter from joined[]. Must hold rooms_lock.
+static void rebuild_own_filter() {
+  memset(own_filter, 0, sizeof(own_filter));
+  for (int i = 0; i < num_joined; i++) {
+    filter_room(own_filter, joined[i], true);
+  }
+}
+
+bool rooms_join(const char* room) {
+  size_t len = strlen(room);
+  if (len == 0 || len > ROOM_LEN || strchr(room, ' ') != NULL) return false;
+
+  pthread_mutex_lock(&rooms_lock);
+
+  // Joining a room again just makes it current
+  char* name = NULL;
+  for (int i = 0; i < num_joined; i++) {
+    if (strcmp(joined[i], room) == 0) {
+      name = joined[i];
+      memmove(&joined[i], &joined[i + 1], (num_joined - i - 1) * sizeof(char*));
+      num_joined--;
+      break;
+    }
+  }
+  if (name == NULL && num_joined == ROOMS_MAX) {
+    pthread_mutex_unlock(&rooms_lock);
+    return false;
+  }
+  joined[num_joined++] = name != NULL ? name : strdup(room);
+  rebuild_own_filter();
+
+  pthread_mutex_unlock(&rooms_lock);
+
+  rooms_advertise();
+  return true;
+}
+
+bool rooms_leave(const char* room) {
+  pthread_mutex_lock(&rooms_lock);
+
+  bool found = false;
+  for (int i = 0; i < num_joined; i++) {
+    if (strcmp(joined[i], room) == 0) {
+      free(joined[i]);
+      memmove(&joined[i], &joined[i + 1], (num_joined - i - 1) * sizeof(char*));
+      num_joined--;
+      found = true;
+      break;
+    }
+  }
+  rebuild_own_filter();
+
+  pthread_mutex_unlock(&rooms_lock);
+
+  if (found) rooms_advertise();
+  return found;
+}
+
+bool rooms_current(char* room) {
+  pthread_mutex_lock(&rooms_lock);
+  bool found = num_joined > 0;
+  if (found) strcpy(room, joined[num_joined - 1]);
+  pthread_mutex_unlock(&rooms_lock);
+  return found;
+}
+
+void rooms_display(const char* room, const char* username, const char* message) {
+  history_add(room, username, message);
+  if (room == NULL) {
+    ui_display(username, message);
+    return;
+  }
+
+  // Show the room after the username, e.g. "alice #general: hi"
+  char label[strlen(username) + strlen(room) + 3];
+  snprintf(label, sizeof(label), "%s #%s", username, room);
+  ui_display(label, message);
+}
+
+bool rooms_joined(const char* room) {
+  pthread_mutex_lock(&rooms_lock);
+  bool found = false;
+  for (int i = 0; i < num_joined && !found; i++) {
+    found = strcmp(joined[i], room) == 0;
+  }
+  pthread_mutex_unlock(&rooms_lock);
+  return found;
+}
+
+bool rooms_wants(int fd, const char* room) {
+  pthread_mutex_lock(&rooms_lock);
+  room_link* l = link_get(links, fd);
+  bool wants = l != NULL && filter_room(l->received, room, false);
+  pthread_mutex_unlock(&rooms_lock);
+  return wants;
+}
+
+void rooms_update(int fd, const unsigned char* filter) {
+  pthread_mutex_lock(&rooms_lock);
+  room_link* l = find_link(fd);
+  if (l != NULL) memcpy(l->received, filter, ROOMS_FILTER_BYTES);
+  pthread_mutex_unlock(&rooms_lock);
+
+  // Our neighbors' view of this subtree may have changed
+  rooms_advertise();
+}
+
+void rooms_peer_removed(int fd) {
+  pthread_mutex_lock(&rooms_lock);
+  room_link* l = link_get(links, fd);
+  link_set(links, fd, NULL);
+  free(l);
+  pthread_mutex_unlock(&rooms_lock);
+}
+
+void rooms_advertise() {
+  // Peers whose link failed. They are removed once rooms_lock is released,
+  // since removing a peer also takes it
+  int failed[CAPACITY];
+  int num_failed = 0;
+
+  // Writes to peers are serialized by peers_lock, like broadcast()
+  pthread_mutex_lock(&peers_lock);
+  pthread_mutex_lock(&rooms_lock);
+
+  for (int i = 0; i < num_peers; i++) {
+    room_link* l = find_link(peers[i]);
+    if (l == NULL) continue;
+
+    // Everything reachable through us, except what lies behind this link
+    unsigned char summary[ROOMS_FILTER_BYTES];
+    memcpy(summary, own_filter, ROOMS_FILTER_BYTES);
+    for (int j = 0; j < num_peers; j++) {
+      room_link* other = link_get(links, peers[j]);
+      if (other == NULL || other == l) continue;
+      for (int b = 0; b < ROOMS_FILTER_BYTES; b++) summary[b] |= other->received[b];
+    }
+
+    if (memcmp(summary, l->advertised, ROOMS_FILTER_BYTES) == 0) continue;
+
+    size_t kind = FRAME_INTEREST;
+    transport_cork(l->fd, true);
+    if (batch_flush(l->fd) == 0 &&
+        write_helper(l->fd, (char*)&kind, sizeof(size_t)) == (ssize_t)sizeof(size_t) &&
+        write_helper(l->fd, summary, ROOMS_FILTER_BYTES) == ROOMS_FILTER_BYTES) {
+      memcpy(l->advertised, summary, ROOMS_FILTER_BYTES);
+    } else {
+      failed[num_failed++] = l->fd;
+    }
+    transport_cork(l->fd, false);
+  }
+
+  pthread_mutex_unlock(&rooms_lock);
+  for (int i = 0; i < num_failed; i++) remove_peer(failed[i]);
+  pthread_mutex_unlock(&peers_lock);
+
+  // The remaining peers no longer reach the rooms behind the removed ones
+  if (num_failed > 0) rooms_advertise();
+}
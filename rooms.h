@@ -0,0 +1,82 @@
+#if !defined(ROOMS_H)
+#define ROOMS_H
+
+#include <stdbool.h>
+
+// Size of the Bloom filter that summarizes a set of rooms
+#define ROOMS_FILTER_BYTES 32
+
+// Longest room name accepted by :join
+#define ROOM_LEN 64
+
+/**
+ * Named rooms and interest-based routing.
+ *
+ * Each node tells every neighbor which rooms can be reached through it: a Bloom
+ * filter of the rooms it joined itself, merged with the filters it received
+ * from all of its other neighbors. Since every node joins the chat through a
+ * single existing peer, the peers form a tree, so the filter a neighbor sends
+ * us covers exactly the subtree behind that link. A room message is only
+ * written to links whose filter matches the room. Messages outside any room
+ * still go to everyone.
+ */
+
+/**
+ * Join a room and make it the room new messages are sent to.
+ *
+ * \returns   false if the name is empty, too long, or too many rooms are joined.
+ */
+bool rooms_join(const char* room);
+
+/**
+ * Leave a room. If it was the current room, the most recently joined remaining
+ * room becomes current, or messages go back to everyone.
+ *
+ * \returns   false if the room was not joined.
+ */
+bool rooms_leave(const char* room);
+
+/**
+ * Copy out the room typed messages are sent to.
+ *
+ * \param room  Room for the name, at least ROOM_LEN + 1 bytes.
+ *
+ * \returns     false if messages go to everyone instead.
+ */
+bool rooms_current(char* room);
+
+/**
+ * Show a message in the display pane, labelled with its room if it has one,
+ * and add it to the history.
+ */
+void rooms_display(const char* room, const char* username, const char* message);
+
+/**
+ * Check whether this node joined a room.
+ */
+bool rooms_joined(const char* room);
+
+/**
+ * Check whether anyone behind a peer link is interested in a room. Called by
+ * broadcast() with peers_lock held.
+ */
+bool rooms_wants(int fd, const char* room);
+
+/**
+ * Record the interest filter a peer advertised.
+ */
+void rooms_update(int fd, const unsigned char* filter);
+
+/**
+ * Forget the interest of a peer that was removed from the peer list. Called
+ * with peers_lock held.
+ */
+void rooms_peer_removed(int fd);
+
+/**
+ * Send each peer our current interest summary if it changed since the last one
+ * it was sent. Must not be called with peers_lock held.
+ */
+void rooms_advertise();
+
+#endif
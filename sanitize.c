@@ -0,0 +1,302 @@
+#include "sanitize.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// AVX2 is chosen at run time, so the rest of the program does not need -mavx2
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define SANITIZE_AVX2 1
+#include <immintrin.h>
+#endif
+
+// Handle the byte at text[i], which is not printable ASCII: either accept the
+// well-formed UTF-8 sequence it starts or replace it. Returns the index of the
+// next byte to look at.
+static size_t sanitize_at(char* text, size_t len, size_t i, size_t* replaced) {
+  const unsigned char* s = (const unsigned char*)text;
+  unsigned char c = s[i];
+
+  // C0 controls and DEL
+  if (c < 0x80) {
+    text[i] = '?';
+    (*replaced)++;
+    return i + 1;
+  }
+
+  // Number of continuation bytes, and the allowed range of the first one,
+  // which rules out overlong forms, surrogates and code points past U+10FFFF
+  size_t n = 0;
+  unsigned char lo = 0x80;
+  unsigned char hi = 0xBF;
+  if (c >= 0xC2 && c <= 0xDF) {
+    n = 1;
+    // U+0080..U+009F are the C1 controls, e.g. the single-byte CSI
+    if (c == 0xC2) lo = 0xA0;
+  } else if (c == 0xE0) {
+    n = 2;
+    lo = 0xA0;
+  } else if ((c >= 0xE1 && c <= 0xEC) || c == 0xEE || c == 0xEF) {
+    n = 2;
+  } else if (c == 0xED) {
+    n = 2;
+    hi = 0x9F;
+  } else if (c == 0xF0) {
+    n = 3;
+    lo = 0x90;
+  } else if (c >= 0xF1 && c <= 0xF3) {
+    n = 3;
+  } else if (c == 0xF4) {
+    n = 3;
+    hi = 0x8F;
+  }
+
+  bool ok = n > 0 && i + n < len && s[i + 1] >= lo && s[i + 1] <= hi;
+  for (size_t k = 2; ok && k <= n; k++) {
+    ok = s[i + k] >= 0x80 && s[i + k] <= 0xBF;
+  }
+
+  if (!ok) {
+    // Only the lead byte is replaced; any stray continuation bytes after it
+    // are replaced when we get to them
+    text[i] = '?';
+    (*replaced)++;
+    return i + 1;
+  }
+  return i + n + 1;
+}
+
+// Bytes that are not printable ASCII
+static inline bool needs_check(unsigned char c) {
+  return c < 0x20 || c >= 0x7f;
+}
+
+size_t sanitize_text_scalar(char* text, size_t len) {
+  size_t replaced = 0;
+  size_t i = 0;
+  while (i < len) {
+    if (needs_check(text[i])) {
+      i = sanitize_at(text, len, i, &replaced);
+    } else {
+      i++;
+    }
+  }
+  return replaced;
+}
+
+#if defined(__SSE2__)
+size_t sanitize_text_sse2(char* text, size_t len) {
+  const __m128i space = _mm_set1_epi8(0x20);
+  const __m128i del = _mm_set1_epi8(0x7f);
+  size_t replaced = 0;
+  size_t i = 0;
+
+  while (i + 16 <= len) {
+    size_t base = i;
+    __m128i v = _mm_loadu_si128((const __m128i*)(text + base));
+
+    // The compare is signed, so bytes from 0x80 up count as below space too
+    unsigned mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmplt_epi8(v, space), _mm_cmpeq_epi8(v, del)));
+
+    // Visit each flagged byte, dropping the bits of any sequence accepted
+    size_t next = base;
+    while (mask != 0) {
+      next = sanitize_at(text, len, base + __builtin_ctz(mask), &replaced);
+      mask = next - base >= 16 ? 0 : mask & (~0u << (next - base));
+    }
+    i = next > base + 16 ? next : base + 16;
+  }
+
+  // Finish the last few bytes one at a time
+  while (i < len) {
+    i = needs_check(text[i]) ? sanitize_at(text, len, i, &replaced) : i + 1;
+  }
+  return replaced;
+}
+#endif
+
+#if defined(SANITIZE_AVX2)
+// Error bits for the UTF-8 check below. Each names a way a pair of bytes can be
+// malformed; a pair is bad if a bit is set in all three lookups for it. This is
+// the lookup method of Keiser and Lemire, "Validating UTF-8 In Less Than One
+// Instruction Per Byte".
+#define TOO_SHORT (1 << 0)       // Lead byte not followed by a continuation
+#define TOO_LONG (1 << 1)        // ASCII followed by a continuation
+#define OVERLONG_3 (1 << 2)      // E0 80..9F
+#define TOO_LARGE (1 << 3)       // Past U+10FFFF
+#define SURROGATE (1 << 4)       // ED A0..BF
+#define OVERLONG_2 (1 << 5)      // C0, C1
+#define TOO_LARGE_1000 (1 << 6)  // F5.. followed by 80..8F
+#define OVERLONG_4 (1 << 6)      // F0 80..8F
+#define TWO_CONTS (1 << 7)       // Two continuations, unless a 3/4 byte sequence
+#define CARRY (TOO_SHORT | TOO_LONG | TWO_CONTS)
+
+// Look up each byte's high or low nibble in a 16 entry table
+#define TABLE16(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+// Run the scalar loop from a character boundary until at least index end.
+// Returns where it stopped, which is again a character boundary.
+static size_t sanitize_range(char* text, size_t len, size_t i, size_t end, size_t* replaced) {
+  while (i < end && i < len) {
+    i = needs_check(text[i]) ? sanitize_at(text, len, i, replaced) : i + 1;
+  }
+  return i;
+}
+
+// Find where the character that contains text[i], or that was cut off just
+// before it, starts. This is where the scalar loop can safely pick up.
+static size_t char_start(const char* text, size_t i) {
+  for (size_t back = 1; back <= 3 && back <= i; back++) {
+    unsigned char c = text[i - back];
+    if ((c & 0xC0) == 0x80) continue;
+
+    // ASCII or a lead byte: it owns text[i] if its sequence reaches that far
+    size_t n = c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+    return n > back ? i - back : i;
+  }
+  return i;
+}
+
+__attribute__((target("avx2"))) size_t sanitize_text_avx2(char* text, size_t len) {
+  const __m256i byte_1_high = TABLE16(
+      TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,  // 0___
+      TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,                                      // 10__
+      TOO_SHORT | OVERLONG_2,                                                          // 1100
+      TOO_SHORT,                                                                       // 1101
+      TOO_SHORT | OVERLONG_3 | SURROGATE,                                              // 1110
+      TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4);                            // 1111
+  const __m256i byte_1_low = TABLE16(
+      CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,  // ____0000
+      CARRY | OVERLONG_2,                            // ____0001
+      CARRY, CARRY,                                  // ____001_
+      CARRY | TOO_LARGE,                             // ____0100
+      CARRY | TOO_LARGE | TOO_LARGE_1000,            // ____0101
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000,
+      CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,  // ____1101
+      CARRY | TOO_LARGE | TOO_LARGE_1000, CARRY | TOO_LARGE | TOO_LARGE_1000);
+  const __m256i byte_2_high = TABLE16(
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,  // 0___
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,           // 1000
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,                             // 1001
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,                              // 1010
+      TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,                              // 1011
+      TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT);                                            // 11__
+  const __m256i nibble = _mm256_set1_epi8(0x0F);
+  const __m256i high_bit = _mm256_set1_epi8((char)0x80);
+  const __m256i last_c0 = _mm256_set1_epi8(0x1F);
+  const __m256i del = _mm256_set1_epi8(0x7F);
+  const __m256i c1_lead = _mm256_set1_epi8((char)0xC2);
+  const __m256i last_c1 = _mm256_set1_epi8((char)0x9F);
+
+  // Every block also looks at the three bytes before it
+  size_t replaced = 0;
+  size_t i = sanitize_range(text, len, 0, 3, &replaced);
+
+  while (i + 32 <= len) {
+    const char* p = text + i;
+    __m256i input = _mm256_loadu_si256((const __m256i*)p);
+    __m256i prev1 = _mm256_loadu_si256((const __m256i*)(p - 1));
+
+    // C0 controls, DEL, and C1 controls (C2 followed by 80..9F)
+    __m256i bad = _mm256_cmpeq_epi8(_mm256_max_epu8(input, last_c0), last_c0);
+    bad = _mm256_or_si256(bad, _mm256_cmpeq_epi8(input, del));
+    bad = _mm256_or_si256(bad, _mm256_and_si256(_mm256_cmpeq_epi8(prev1, c1_lead),
+                                                _mm256_cmpeq_epi8(_mm256_max_epu8(input, last_c1), last_c1)));
+
+    // Only check the UTF-8 if this block or the bytes before it are not ASCII
+    __m256i prev3 = _mm256_loadu_si256((const __m256i*)(p - 3));
+    if (_mm256_movemask_epi8(_mm256_or_si256(input, prev3)) != 0) {
+      __m256i prev2 = _mm256_loadu_si256((const __m256i*)(p - 2));
+
+      // Errors visible in each pair of adjacent bytes
+      __m256i special = _mm256_and_si256(
+          _mm256_and_si256(
+              _mm256_shuffle_epi8(byte_1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble)),
+              _mm256_shuffle_epi8(byte_1_low, _mm256_and_si256(prev1, nibble))),
+          _mm256_shuffle_epi8(byte_2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), nibble)));
+
+      // The third and fourth bytes of a sequence must be continuations, which
+      // the pair check above reports as TWO_CONTS. Cancel those out.
+      __m256i third = _mm256_subs_epu8(prev2, _mm256_set1_epi8(0xE0 - 0x80));
+      __m256i fourth = _mm256_subs_epu8(prev3, _mm256_set1_epi8((char)(0xF0 - 0x80)));
+      __m256i must_continue = _mm256_and_si256(_mm256_or_si256(third, fourth), high_bit);
+      __m256i error = _mm256_xor_si256(must_continue, special);
+
+      // Any error bit makes the byte bad, not just the top one movemask reads
+      bad = _mm256_or_si256(bad, _mm256_andnot_si256(_mm256_cmpeq_epi8(error, _mm256_setzero_si256()), high_bit));
+    }
+
+    unsigned mask = _mm256_movemask_epi8(bad);
+    if (mask == 0) {
+      i += 32;
+      continue;
+    }
+
+    // Fix the first character that needs it one byte at a time, then go back
+    // to whole blocks right after it. Errors are flagged on the byte where the
+    // sequence goes wrong, so start from the beginning of its character.
+    size_t pos = i + __builtin_ctz(mask);
+    i = sanitize_range(text, len, char_start(text, pos), pos + 1, &replaced);
+  }
+
+  // Finish the last few bytes, including any character the last block cut off
+  sanitize_range(text, len, char_start(text, i), len, &replaced);
+  return replaced;
+}
+
+#endif
+
+// Builds without an implementation still link; sanitize_has says not to call it
+#if !defined(__SSE2__)
+size_t sanitize_text_sse2(char* text, size_t len) {
+  return sanitize_text_scalar(text, len);
+}
+#endif
+
+#if !defined(SANITIZE_AVX2)
+size_t sanitize_text_avx2(char* text, size_t len) {
+  return sanitize_text_scalar(text, len);
+}
+#endif
+
+static bool have_avx2() {
+#if defined(SANITIZE_AVX2)
+  static int supported = -1;
+  if (supported == -1) supported = __builtin_cpu_supports("avx2");
+  return supported;
+#else
+  return false;
+#endif
+}
+
+bool sanitize_has(sanitize_fn impl) {
+  if (impl == sanitize_text_avx2) return have_avx2();
+#if !defined(__SSE2__)
+  if (impl == sanitize_text_sse2) return false;
+#endif
+  return true;
+}
+
+size_t sanitize_text(char* text, size_t len) {
+  if (have_avx2()) return sanitize_text_avx2(text, len);
+#if defined(__SSE2__)
+  return sanitize_text_sse2(text, len);
+#else
+  return sanitize_text_scalar(text, len);
+#endif
+}
+
+const char* sanitize_text_impl() {
+  if (have_avx2()) return "avx2";
+#if defined(__SSE2__)
+  return "sse2";
+#else
+  return "scalar";
+#endif
+}
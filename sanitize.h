@@ -0,0 +1,54 @@
+#if !defined(SANITIZE_H)
+#define SANITIZE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * Make text received from a peer safe to hand to the terminal. Control
+ * characters (C0, DEL and the C1 range U+0080..U+009F) and every byte that is
+ * not part of a well-formed UTF-8 sequence are replaced with '?' in place, so
+ * the length never changes.
+ *
+ * With AVX2 the text is validated 32 bytes at a time, and only characters
+ * that need replacing are handled one byte at a time. With SSE2, runs of
+ * printable ASCII are skipped 16 bytes at a time and everything else is
+ * checked one character at a time. Other CPUs use sanitize_text_scalar.
+ *
+ * \param text  The text to clean. It does not need to be null-terminated.
+ * \param len   The number of bytes in text.
+ *
+ * \returns     The number of bytes that were replaced.
+ */
+size_t sanitize_text(char* text, size_t len);
+
+/**
+ * The same as sanitize_text, checking one byte at a time. Kept as the baseline
+ * for the benchmark in sanitize_bench.c.
+ */
+size_t sanitize_text_scalar(char* text, size_t len);
+
+/**
+ * The SSE2 and AVX2 implementations sanitize_text chooses between, so the
+ * benchmark can check and time each of them. Only call one if sanitize_has
+ * says this build and CPU can run it.
+ */
+size_t sanitize_text_sse2(char* text, size_t len);
+size_t sanitize_text_avx2(char* text, size_t len);
+
+/**
+ * The type of sanitize_text and each of its implementations.
+ */
+typedef size_t (*sanitize_fn)(char* text, size_t len);
+
+/**
+ * Check whether this build and CPU can run one of the implementations above.
+ */
+bool sanitize_has(sanitize_fn impl);
+
+/**
+ * The name of the implementation sanitize_text uses on this CPU.
+ */
+const char* sanitize_text_impl();
+
+#endif
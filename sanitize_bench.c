@@ -0,0 +1,175 @@
+// Microbenchmark for the implementations of sanitize_text against the scalar
+// baseline.
+//
+// Each input is a buffer of chat messages of a given size and mix of
+// characters. Every implementation this CPU can run cleans fresh copies of it
+// repeatedly, and its results are compared byte for byte with the scalar
+// baseline before anything is timed.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "sanitize.h"
+#include "util.h"
+
+// Bytes cleaned per implementation and input
+#define BENCH_TOTAL (256u << 20)
+
+// Random buffers compared between each implementation and the baseline
+#define BENCH_CHECKS 20000
+
+// Number of implementations, the scalar baseline first
+#define BENCH_IMPLS 3
+
+static const sanitize_fn impls[BENCH_IMPLS] = {sanitize_text_scalar, sanitize_text_sse2, sanitize_text_avx2};
+static const char* impl_names[BENCH_IMPLS] = {"scalar", "sse2", "avx2"};
+
+// Kinds of input text
+typedef enum {
+  TEXT_ASCII,    // Plain English chat
+  TEXT_MIXED,    // Mostly ASCII with accented letters and emoji
+  TEXT_CJK,      // Almost entirely three-byte characters
+  TEXT_HOSTILE,  // Chat sprinkled with escape sequences and invalid bytes
+} text_kind;
+
+// Append one character of the requested kind, returning the new length
+static size_t put_char(char* buf, size_t len, size_t cap, text_kind kind) {
+  static const char* words = "the quick brown fox jumps over the lazy dog ";
+  int r = rand() % 100;
+  const char* c;
+  char ascii[2] = {words[rand() % 44], '\0'};
+
+  switch (kind) {
+    case TEXT_MIXED:
+      c = r < 90 ? ascii : r < 97 ? "\xc3\xa9" : "\xf0\x9f\x98\x80";
+      break;
+    case TEXT_CJK:
+      c = r < 5 ? ascii : "\xe4\xbd\xa0";
+      break;
+    case TEXT_HOSTILE:
+      c = r < 95 ? ascii : r < 97 ? "\x1b[2J" : r < 99 ? "\xc2\x9b" : "\xff";
+      break;
+    default:
+      c = ascii;
+  }
+
+  size_t n = strlen(c);
+  if (len + n > cap) return len;
+  memcpy(buf + len, c, n);
+  return len + n;
+}
+
+static void fill(char* buf, size_t len, text_kind kind) {
+  size_t filled = 0;
+  while (filled < len) {
+    size_t next = put_char(buf, filled, len, kind);
+    if (next == filled) buf[filled++] = ' ';
+    else filled = next;
+  }
+}
+
+// Make sure an implementation agrees with the scalar one on random bytes of
+// random lengths
+static bool check_agreement(int impl) {
+  char a[512];
+  char b[512];
+  for (int i = 0; i < BENCH_CHECKS; i++) {
+    size_t len = rand() % sizeof(a);
+    for (size_t j = 0; j < len; j++) {
+      // Bias towards ASCII so the vector loop gets exercised too
+      a[j] = rand() % 4 == 0 ? (char)(rand() % 256) : (char)(0x20 + rand() % 95);
+    }
+    memcpy(b, a, len);
+    if (sanitize_text_scalar(a, len) != impls[impl](b, len) || memcmp(a, b, len) != 0) {
+      fprintf(stderr, "%s disagrees with the scalar version on a %zu byte input\n", impl_names[impl], len);
+      return false;
+    }
+  }
+  return true;
+}
+
+// Time one implementation over an input, returning MB/s
+static double run(sanitize_fn fn, const char* input, char* work, size_t len) {
+  size_t rounds = BENCH_TOTAL / len;
+  uint64_t start = now_ns();
+  for (size_t i = 0; i < rounds; i++) {
+    memcpy(work, input, len);
+    fn(work, len);
+  }
+  uint64_t elapsed = now_ns() - start;
+
+  // Take the cost of the copies back out
+  start = now_ns();
+  for (size_t i = 0; i < rounds; i++) {
+    memcpy(work, input, len);
+    __asm__ volatile("" : : "r"(work) : "memory");
+  }
+  uint64_t copy = now_ns() - start;
+  if (copy < elapsed) elapsed -= copy;
+
+  return (double)rounds * len / (elapsed / 1e9) / 1e6;
+}
+
+int main() {
+  srand(1);
+  for (int impl = 1; impl < BENCH_IMPLS; impl++) {
+    if (sanitize_has(impls[impl]) && !check_agreement(impl)) return 1;
+  }
+
+  const char* names[] = {"ascii", "mixed", "cjk", "hostile"};
+  size_t sizes[] = {32, 200, 2048, 65536};
+
+  // Speedups are against the scalar baseline; "-" marks what this CPU lacks
+  printf("sanitize_text uses %s\n\n", sanitize_text_impl());
+  printf("%-8s %8s", "input", "bytes");
+  for (int impl = 0; impl < BENCH_IMPLS; impl++) printf(" %8s MB/s", impl_names[impl]);
+  for (int impl = 1; impl < BENCH_IMPLS; impl++) printf(" %7s x", impl_names[impl]);
+  printf("\n");
+
+  for (int kind = TEXT_ASCII; kind <= TEXT_HOSTILE; kind++) {
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+      size_t len = sizes[s];
+      char* input = malloc(len);
+      char* work = malloc(len);
+      char* expected = malloc(len);
+      fill(input, len, kind);
+
+      // Every implementation must produce the same text
+      memcpy(expected, input, len);
+      sanitize_text_scalar(expected, len);
+      double rates[BENCH_IMPLS];
+      for (int impl = 0; impl < BENCH_IMPLS; impl++) {
+        rates[impl] = 0;
+        if (!sanitize_has(impls[impl])) continue;
+
+        memcpy(work, input, len);
+        impls[impl](work, len);
+        if (memcmp(work, expected, len) != 0) {
+          fprintf(stderr, "%s disagrees with the scalar version on %s input\n", impl_names[impl], names[kind]);
+          return 1;
+        }
+        rates[impl] = run(impls[impl], input, work, len);
+      }
+
+      printf("%-8s %8zu", names[kind], len);
+      for (int impl = 0; impl < BENCH_IMPLS; impl++) {
+        if (rates[impl] > 0) printf(" %13.0f", rates[impl]);
+        else printf(" %13s", "-");
+      }
+      for (int impl = 1; impl < BENCH_IMPLS; impl++) {
+        if (rates[impl] > 0) printf(" %8.1fx", rates[impl] / rates[0]);
+        else printf(" %9s", "-");
+      }
+      printf("\n");
+
+      free(input);
+      free(work);
+      free(expected);
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,275 @@
+#include "transport.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "local.h"
+#include "ui.h"
+#include "util.h"
+
+extern pthread_mutex_t peers_lock;
+extern intptr_t peers[];
+extern int num_peers;
+
+// Describe a peer's address, e.g. "10.0.0.2:4000"
+static void peer_address(int fd, char* address, size_t len) {
+  struct sockaddr_in addr;
+  socklen_t addrlen = sizeof(addr);
+  snprintf(address, len, "fd %d", fd);
+  if (getpeername(fd, (struct sockaddr*)&addr, &addrlen) == 0 && addr.sin_family == AF_INET) {
+    char ip[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &addr.sin_addr, ip, sizeof(ip));
+    snprintf(address, len, "%s:%d", ip, ntohs(addr.sin_port));
+  }
+}
+
+#if defined(__linux__)
+
+#include <linux/tcp.h>
+#include <poll.h>
+
+// What we measured and chose for one TCP link
+typedef struct {
+  int fd;
+  uint64_t last_ns;   // When the counters below were read
+  uint64_t acked;     // Bytes the peer had acknowledged
+  uint64_t received;  // Bytes we had received
+  uint32_t rtt_us;    // Smoothed round-trip time
+  uint64_t out_rate;  // Recent peak of bytes per second sent
+  uint64_t in_rate;   // Recent peak of bytes per second received
+  int sndbuf;         // SO_SNDBUF we set, or 0 while the kernel tunes it
+  int rcvbuf;         // SO_RCVBUF we set, or 0 while the kernel tunes it
+  bool sndbuf_done;   // SO_SNDBUF needed more than we may set, so is left as is
+  bool rcvbuf_done;   // The same for SO_RCVBUF
+} transport_link;
+
+static bool latency = false;
+
+// Largest buffers the system lets us set, from net.core.[wr]mem_max
+static int max_sndbuf;
+static int max_rcvbuf;
+
+// Protected by peers_lock
+static link_table links;
+
+static int read_sysctl(const char* path, int fallback) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) return fallback;
+  int value;
+  if (fscanf(f, "%d", &value) != 1 || value <= 0) value = fallback;
+  fclose(f);
+  return value;
+}
+
+// Size one buffer of a link to twice its bandwidth-delay product. Setting a
+// size turns the kernel's own tuning off for good, so a buffer is only ever
+// grown past what the kernel already gives it, by more than a quarter. Once a
+// link needs more than max, it is left alone: the kernel's tuning can go
+// further than we may, and a buffer we already set gets the most we can.
+static void tune_buf(int fd, int option, uint64_t rate, uint32_t rtt_us, int max, int* chosen, bool* done) {
+  if (*done) return;
+
+  uint64_t want = 2 * rate * rtt_us / 1000000;
+  if (want > (uint64_t)max) {
+    if (*chosen != 0 && setsockopt(fd, SOL_SOCKET, option, &max, sizeof(int)) == 0) *chosen = max;
+    *done = true;
+    return;
+  }
+
+  // The kernel reports twice the size that was set, to cover its bookkeeping
+  int current = 0;
+  socklen_t len = sizeof(int);
+  if (getsockopt(fd, SOL_SOCKET, option, &current, &len)) return;
+  if (want * 2 * 4 <= (uint64_t)current * 5) return;
+
+  int size = want < TRANSPORT_MIN_BUF ? TRANSPORT_MIN_BUF : want;
+  if (setsockopt(fd, SOL_SOCKET, option, &size, sizeof(int)) == 0) *chosen = size;
+}
+
+// Measure a link and resize its buffers if needed
+static void tune_link(transport_link* l) {
+  struct tcp_info info;
+  socklen_t len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  if (getsockopt(l->fd, IPPROTO_TCP, TCP_INFO, &info, &len)) return;
+
+  uint64_t now = now_ns();
+  uint64_t elapsed = now - l->last_ns;
+  uint64_t out = (info.tcpi_bytes_acked - l->acked) * 1000000000 / elapsed;
+  uint64_t in = (info.tcpi_bytes_received - l->received) * 1000000000 / elapsed;
+  l->last_ns = now;
+  l->acked = info.tcpi_bytes_acked;
+  l->received = info.tcpi_bytes_received;
+  l->rtt_us = info.tcpi_rtt;
+
+  // Remember the busiest recent second, so a bulk link does not lose its
+  // buffers to a short lull
+  l->out_rate = out > l->out_rate * 3 / 4 ? out : l->out_rate * 3 / 4;
+  l->in_rate = in > l->in_rate * 3 / 4 ? in : l->in_rate * 3 / 4;
+
+  tune_buf(l->fd, SO_SNDBUF, l->out_rate, l->rtt_us, max_sndbuf, &l->sndbuf, &l->sndbuf_done);
+  tune_buf(l->fd, SO_RCVBUF, l->in_rate, l->rtt_us, max_rcvbuf, &l->rcvbuf, &l->rcvbuf_done);
+}
+
+// Thread that measures every link once per TRANSPORT_TUNE_MS
+static void* transport_thread(void* arg) {
+  while (1) {
+    usleep(TRANSPORT_TUNE_MS * 1000);
+    pthread_mutex_lock(&peers_lock);
+    for (int i = 0; i < num_peers; i++) {
+      transport_link* l = link_get(links, peers[i]);
+      if (l != NULL) tune_link(l);
+    }
+    pthread_mutex_unlock(&peers_lock);
+  }
+  return NULL;
+}
+
+int transport_open(const char* name) {
+  if (strcmp(name, "default") == 0) return 0;
+  if (strcmp(name, "latency") != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  latency = true;
+  max_sndbuf = read_sysctl("/proc/sys/net/core/wmem_max", 212992);
+  max_rcvbuf = read_sysctl("/proc/sys/net/core/rmem_max", 212992);
+
+  pthread_t thread_id;
+  if (pthread_create(&thread_id, NULL, transport_thread, NULL)) return -1;
+  pthread_detach(thread_id);
+  return 0;
+}
+
+void transport_peer_added(int fd) {
+  if (!latency || local_is_link(fd)) return;
+
+  int on = 1;
+  int lowat = TRANSPORT_NOTSENT_LOWAT;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(int));
+  setsockopt(fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(int));
+
+  transport_link* l = calloc(1, sizeof(*l));
+  if (l == NULL) return;
+  l->fd = fd;
+  l->last_ns = now_ns();
+  if (!link_set(links, fd, l)) free(l);
+}
+
+void transport_peer_removed(int fd) {
+  transport_link* l = link_get(links, fd);
+  if (l == NULL) return;
+  link_set(links, fd, NULL);
+  free(l);
+}
+
+void transport_cork(int fd, bool cork) {
+  if (!latency || link_get(links, fd) == NULL) return;
+  int on = cork;
+  setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(int));
+}
+
+bool transport_writable(int fd) {
+  if (!latency || link_get(links, fd) == NULL) return true;
+
+  // POLLOUT follows TCP_NOTSENT_LOWAT. Errors count as writable, so the write
+  // fails and the peer is removed
+  struct pollfd p = {.fd = fd, .events = POLLOUT};
+  return poll(&p, 1, 0) != 0;
+}
+
+// Describe one buffer size: the one we chose, or the kernel's current one
+static void describe_buf(int fd, int option, int chosen, char* text, size_t len) {
+  if (chosen != 0) {
+    snprintf(text, len, "%d KiB", chosen / 1024);
+    return;
+  }
+  int size = 0;
+  socklen_t size_len = sizeof(int);
+  getsockopt(fd, SOL_SOCKET, option, &size, &size_len);
+  snprintf(text, len, "auto (%d KiB)", size / 1024);
+}
+
+// Describe one peer link for transport_report. Must hold peers_lock.
+static void describe_peer(int fd, char* text, size_t len) {
+  char address[INET_ADDRSTRLEN + 8];
+  peer_address(fd, address, sizeof(address));
+
+  if (local_is_link(fd)) {
+    snprintf(text, len, "%s: shared memory on this host", address);
+    return;
+  }
+
+  transport_link* l = link_get(links, fd);
+  struct tcp_info info;
+  socklen_t info_len = sizeof(info);
+  memset(&info, 0, sizeof(info));
+  getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_len);
+
+  char sndbuf[32];
+  char rcvbuf[32];
+  describe_buf(fd, SO_SNDBUF, l != NULL ? l->sndbuf : 0, sndbuf, sizeof(sndbuf));
+  describe_buf(fd, SO_RCVBUF, l != NULL ? l->rcvbuf : 0, rcvbuf, sizeof(rcvbuf));
+
+  if (l == NULL) {
+    snprintf(text, len, "%s: rtt %.2f ms, sndbuf %s, rcvbuf %s, kernel defaults", address,
+             info.tcpi_rtt / 1000.0, sndbuf, rcvbuf);
+  } else {
+    snprintf(text, len,
+             "%s: rtt %.2f ms, %.1f KB/s out, %.1f KB/s in, sndbuf %s, rcvbuf %s, notsent lowat %d KiB, nodelay",
+             address, info.tcpi_rtt / 1000.0, l->out_rate / 1000.0, l->in_rate / 1000.0, sndbuf, rcvbuf,
+             TRANSPORT_NOTSENT_LOWAT / 1024);
+  }
+}
+
+#else
+
+// Other systems have no TCP_INFO or TCP_NOTSENT_LOWAT; only the default
+// profile exists
+
+int transport_open(const char* name) {
+  if (strcmp(name, "default") == 0) return 0;
+  errno = EINVAL;
+  return -1;
+}
+
+void transport_peer_added(int fd) {}
+
+void transport_peer_removed(int fd) {}
+
+void transport_cork(int fd, bool cork) {}
+
+bool transport_writable(int fd) {
+  return true;
+}
+
+static void describe_peer(int fd, char* text, size_t len) {
+  char address[INET_ADDRSTRLEN + 8];
+  peer_address(fd, address, sizeof(address));
+  snprintf(text, len, "%s: %s", address, local_is_link(fd) ? "shared memory on this host" : "kernel defaults");
+}
+
+#endif
+
+void transport_report() {
+  // Describe every peer under the lock, then show them without it
+  pthread_mutex_lock(&peers_lock);
+  int count = num_peers;
+  char(*lines)[256] = malloc((count > 0 ? count : 1) * sizeof(*lines));
+  for (int i = 0; i < count; i++) describe_peer(peers[i], lines[i], sizeof(lines[i]));
+  pthread_mutex_unlock(&peers_lock);
+
+  if (count == 0) ui_display("INFO", "No peers connected.");
+  for (int i = 0; i < count; i++) ui_display("INFO", lines[i]);
+  free(lines);
+}
@@ -0,0 +1,75 @@
+#if !defined(TRANSPORT_H)
+#define TRANSPORT_H
+
+#include <stdbool.h>
+
+/**
+ * Transport profiles for TCP peer links.
+ *
+ * The "default" profile leaves every socket as the kernel set it up. The
+ * "latency" profile turns Nagle off on each link, corks control frames that
+ * are written in several pieces so they still leave in one segment, and sets
+ * TCP_NOTSENT_LOWAT so only about one batch of unsent data waits in the
+ * kernel. Everything else waits in the link's batch queue, where later frames
+ * can still join it. Once a second the profile also reads TCP_INFO for every
+ * link, and grows SO_SNDBUF and SO_RCVBUF to twice the bandwidth-delay product
+ * measured on it. Setting a buffer size turns the kernel's own autotuning off
+ * for that socket, so a buffer is only set when the measured product is
+ * larger than what autotuning already gave it, and never shrunk. Once a link
+ * needs more than the system maximum allows us to set, it is left alone.
+ *
+ * Peers on this host use shared memory and are left alone. Only Linux builds
+ * have the latency profile.
+ */
+
+// Unsent bytes the kernel holds for a link under the latency profile
+#define TRANSPORT_NOTSENT_LOWAT (16 * 1024)
+
+// Smallest buffer size set on a link
+#define TRANSPORT_MIN_BUF (64 * 1024)
+
+// How often links are measured, in milliseconds
+#define TRANSPORT_TUNE_MS 1000
+
+/**
+ * Select a transport profile and start measuring links if it needs to.
+ *
+ * \param name  "default" or "latency".
+ *
+ * \returns     0 on success, or -1 with errno set if the profile is unknown or
+ *              its thread could not be started.
+ */
+int transport_open(const char* name);
+
+/**
+ * Apply the profile to a newly added peer. Called with peers_lock held.
+ */
+void transport_peer_added(int fd);
+
+/**
+ * Forget a removed peer. Called with peers_lock held.
+ */
+void transport_peer_removed(int fd);
+
+/**
+ * Hold back partial segments while a frame is written in several pieces, then
+ * send them. Does nothing outside the latency profile. Called with peers_lock
+ * held.
+ */
+void transport_cork(int fd, bool cork);
+
+/**
+ * Check whether the kernel would take more data for a link right away. Under
+ * the latency profile this is false while more than TRANSPORT_NOTSENT_LOWAT
+ * bytes are still unsent, so the batch queue holds on to its frames. Always
+ * true otherwise. Called with peers_lock held.
+ */
+bool transport_writable(int fd);
+
+/**
+ * Show the round-trip time, throughput, and socket settings of every peer in
+ * the display pane.
+ */
+void transport_report();
+
+#endif
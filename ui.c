@@ -9,6 +9,9 @@
 // The height of the input field in the user interface
 #define INPUT_HEIGHT 3
 
+// The number of displayed lines kept in memory for scrolling back
+#define UI_SCROLLBACK 500
+
 // The timeout for input
 #define INPUT_TIMEOUT_MS 10
 
@@ -40,6 +43,225 @@ static input_callback_t input_callback;
 // When true, the UI should continue running
 bool ui_running = false;
 
+// The size of the display pane
+static int display_height;
+static int display_width;
+
+// A line shown in the display pane
+typedef struct {
+  char* text;
+  size_t paged;  // How many lines the pager had once this one was shown
+} ui_line;
+
+// The most recent lines shown in the display pane, and how many there have
+// been in total. Line n is at lines[n % UI_SCROLLBACK]
+static ui_line lines[UI_SCROLLBACK];
+static size_t num_lines = 0;
+
+// Where scrollback comes from once it is older than the lines kept in memory,
+// or NULL if there is nothing older
+static ui_pager_t pager = NULL;
+static ui_pager_count_t pager_count = NULL;
+
+// How many of the pager's lines are older than every line kept in memory.
+// Scrollback is those lines followed by the kept ones
+static size_t paged_lines = 0;
+
+// How many lines back from the newest the display pane is scrolled
+static size_t scroll_back = 0;
+
+// Pager lines fetched for the display pane, starting with line fetched_start.
+// Lines the pager could not return are NULL
+static char** fetched = NULL;
+static size_t fetched_start = 0;
+static size_t fetched_end = 0;
+
+// The pager lines the display pane is waiting for. The pager may read from
+// disk, so the UI thread fetches them without holding ui_lock
+static bool fetch_pending = false;
+static size_t fetch_start;
+static size_t fetch_end;
+
+/**
+ * Count the lines that can be scrolled through.
+ */
+static size_t total_lines() {
+  return paged_lines + (num_lines < UI_SCROLLBACK ? num_lines : UI_SCROLLBACK);
+}
+
+/**
+ * Find where the row of a line that starts at byte start ends. A row holds at
+ * most width bytes, and is cut short rather than split inside a UTF-8
+ * sequence.
+ */
+static size_t row_end(const char* line, size_t len, size_t start, size_t width) {
+  size_t end = start + width;
+  if (end >= len) return len;
+
+  // Continuation bytes of a sequence look like 10xxxxxx
+  while (end > start + 1 && ((unsigned char)line[end] & 0xc0) == 0x80) end--;
+  return end;
+}
+
+/**
+ * Count the rows a line takes in the display pane.
+ */
+static size_t count_rows(const char* line, size_t width) {
+  size_t len = strlen(line);
+  size_t rows = 0;
+  size_t start = 0;
+  do {
+    start = row_end(line, len, start, width);
+    rows++;
+  } while (start < len);
+  return rows;
+}
+
+/**
+ * Copy the rows of a line after its first skip rows into the display pane's
+ * buffer, starting at row row and stopping at the bottom of the pane.
+ */
+static void put_rows(char* buffer, size_t row, size_t height, size_t width, const char* line, size_t skip) {
+  size_t len = strlen(line);
+  size_t start = 0;
+  for (size_t n = 0; row < height; n++) {
+    size_t end = row_end(line, len, start, width);
+    if (n >= skip) memcpy(buffer + row++ * width, line + start, end - start);
+    if (end >= len) break;
+    start = end;
+  }
+}
+
+/**
+ * Fill the display pane with lines ending scroll_back lines before the newest
+ * one, wrapping lines that are wider than the pane. At the oldest line, the
+ * pane is filled from the top instead, so that line is always shown. Lines
+ * that still have to come from the pager leave the pane as it is until the UI
+ * thread has fetched them.
+ */
+static void render() {
+  // Each line takes at least a row, so this many always fill the pane
+  size_t height = display_height;
+  size_t width = display_width;
+  size_t end = total_lines() - scroll_back;
+  size_t start = end > height ? end - height : 0;
+
+  // The part that is older than the kept lines comes from the pager
+  const char* page[height];
+  size_t count = 0;
+  size_t paged_end = end < paged_lines ? end : paged_lines;
+  if (start < paged_end) {
+    if (start < fetched_start || paged_end > fetched_end) {
+      fetch_pending = true;
+      fetch_start = start;
+      fetch_end = paged_end;
+      return;
+    }
+    for (size_t n = start; n < paged_end; n++) {
+      if (fetched[n - fetched_start] != NULL) page[count++] = fetched[n - fetched_start];
+    }
+  }
+
+  // Then the kept lines, the oldest of which is line number oldest
+  size_t oldest = num_lines - (total_lines() - paged_lines);
+  for (size_t n = start > paged_lines ? start : paged_lines; n < end; n++) {
+    page[count++] = lines[(oldest + n - paged_lines) % UI_SCROLLBACK].text;
+  }
+
+  char* buffer = malloc(height * width + 1);
+  memset(buffer, ' ', height * width);
+  buffer[height * width] = '\0';
+  if (start == 0) {
+    // Lay the lines out from the top down
+    size_t row = 0;
+    for (size_t i = 0; i < count && row < height; i++) {
+      put_rows(buffer, row, height, width, page[i], 0);
+      row += count_rows(page[i], width);
+    }
+  } else {
+    // Lay the lines out from the bottom up, showing the end of a line that is
+    // taller than what is left of the pane
+    size_t row = height;
+    for (size_t i = count; i > 0 && row > 0; i--) {
+      size_t rows = count_rows(page[i - 1], width);
+      size_t skip = rows > row ? rows - row : 0;
+      row -= rows - skip;
+      put_rows(buffer, row, height, width, page[i - 1], skip);
+    }
+  }
+  set_field_buffer(display_fields[0], 0, buffer);
+  free(buffer);
+
+  // Redraw the split, marking it while scrolled back
+  for (int i = 0; i < display_width; i++) {
+    mvprintw(display_height, i, "-");
+  }
+  if (scroll_back > 0) {
+    mvprintw(display_height, 2, " %zu lines back, Page Down for newer ", scroll_back);
+  }
+  refresh();
+}
+
+/**
+ * Forget the fetched pager lines. Must hold ui_lock.
+ */
+static void free_fetched() {
+  for (size_t n = fetched_start; n < fetched_end; n++) free(fetched[n - fetched_start]);
+  free(fetched);
+  fetched = NULL;
+  fetched_start = 0;
+  fetched_end = 0;
+}
+
+/**
+ * Fetch the pager lines the display pane is waiting for, then redraw it. Must
+ * not hold ui_lock, so other threads can keep displaying lines while the pager
+ * reads them.
+ */
+static void fetch_page() {
+  pthread_mutex_lock(&ui_lock);
+  bool pending = fetch_pending;
+  size_t start = fetch_start;
+  size_t end = fetch_end;
+  pthread_mutex_unlock(&ui_lock);
+  if (!pending) return;
+
+  // The pager may return fewer lines than asked for. Those are the newest ones
+  char** page = calloc(end - start, sizeof(char*));
+  size_t count = pager(end, end - start, page);
+  memmove(page + (end - start - count), page, count * sizeof(char*));
+  memset(page, 0, (end - start - count) * sizeof(char*));
+
+  pthread_mutex_lock(&ui_lock);
+  free_fetched();
+  fetched = page;
+  fetched_start = start;
+  fetched_end = end;
+  fetch_pending = false;
+  if (ui_running) render();
+  pthread_mutex_unlock(&ui_lock);
+}
+
+/**
+ * Scroll the display pane by some lines, positive to go back. Scrolling stops
+ * once the oldest line is at the top of the pane.
+ */
+static void scroll_display(long by) {
+  size_t back = scroll_back;
+  if (by < 0) {
+    back = (size_t)-by > back ? 0 : back + by;
+  } else {
+    back += by;
+  }
+
+  size_t total = total_lines();
+  size_t oldest = total > (size_t)display_height ? total - display_height : 0;
+  if (back > oldest) back = oldest;
+
+  scroll_back = back;
+  render();
+}
+
 /**
  * Initialize the user interface and set up a callback function that should be
  * called every time there is a new message to send.
@@ -62,8 +284,9 @@ void ui_init(input_callback_t callback) {
   int cols;
   getmaxyx(stdscr, rows, cols);  // This uses a macro to modify rows and cols
 
-  // Calculate the height of the display field
-  int display_height = rows - INPUT_HEIGHT - 1;
+  // Calculate the size of the display field
+  display_height = rows - INPUT_HEIGHT - 1;
+  display_width = cols;
 
   // Create the larger message display window
   // height, width, start row, start col, overflow buffer lines, buffers
@@ -74,9 +297,6 @@ void ui_init(input_callback_t callback) {
   input_fields[0] = new_field(INPUT_HEIGHT, cols, display_height + 1, 0, 0, 0);
   input_fields[1] = NULL;
 
-  // Grow the display field buffer as needed
-  field_opts_off(display_fields[0], O_STATIC);
-
   // Don't advance to the next field automatically when using the input field
   field_opts_off(input_fields[0], O_AUTOSKIP);
 
@@ -119,6 +339,9 @@ void ui_init(input_callback_t callback) {
 void ui_run() {
   // Loop as long as the UI is running
   while (ui_running) {
+    // Fetch the scrollback the display pane is waiting for, if any
+    fetch_page();
+
     // Get a character
     int ch = getch();
 
@@ -133,6 +356,11 @@ void ui_run() {
       // Delete the last character when the user presses backspace
       form_driver(input_form, REQ_DEL_PREV);
 
+    } else if (ch == KEY_PPAGE || ch == KEY_NPAGE) {
+      // Scroll the display pane by a page, keeping one line from the last
+      long page = display_height > 1 ? display_height - 1 : 1;
+      scroll_display(ch == KEY_PPAGE ? page : -page);
+
     } else if (ch == KEY_ENTER || ch == '\n') {
       // When the user presses enter, report new input
 
@@ -193,23 +421,30 @@ void ui_display(const char* username, const char* message) {
 
   // Don't do anything if the UI is not running
   if (ui_running) {
-    // Add a newline
-    form_driver(display_form, REQ_NEW_LINE);
-
-    // Display the username
-    const char* c = username;
-    while (*c != '\0') {
-      form_driver(display_form, *c);
-      c++;
-    }
-    form_driver(display_form, ':');
-    form_driver(display_form, ' ');
-
-    // Copy the message over to the display field
-    c = message;
-    while (*c != '\0') {
-      form_driver(display_form, *c);
-      c++;
+    // Keep the line, replacing the oldest one kept. The pager then holds
+    // every line it had when that one was shown
+    size_t total = total_lines();
+    size_t paged_before = paged_lines;
+    ui_line* line = &lines[num_lines % UI_SCROLLBACK];
+    if (num_lines >= UI_SCROLLBACK) paged_lines = line->paged;
+    free(line->text);
+
+    size_t len = strlen(username) + strlen(message) + 3;
+    line->text = malloc(len);
+    snprintf(line->text, len, "%s: %s", username, message);
+    line->paged = pager_count != NULL ? pager_count() : 0;
+    num_lines++;
+
+    // Only the live view changes; a scrolled back pane stays where it is.
+    // Kept lines there move back by the new line. Paged lines also move back by
+    // the line that went from memory to the pager, unless it never reached the
+    // pager, like notices
+    if (scroll_back == 0) {
+      render();
+    } else if (total - scroll_back > paged_before) {
+      scroll_back++;
+    } else {
+      scroll_back += total_lines() - total;
     }
   } else {
     printf("%s: %s\n", username, message);
@@ -219,6 +454,23 @@ void ui_display(const char* username, const char* message) {
   pthread_mutex_unlock(&ui_lock);
 }
 
+/**
+ * Fetch scrollback that is older than the lines kept in memory from elsewhere.
+ *
+ * \param callback  A function that returns older lines for the display pane.
+ * \param count     A function that counts the lines callback can return.
+ */
+void ui_set_pager(ui_pager_t callback, ui_pager_count_t count) {
+  pthread_mutex_lock(&ui_lock);
+  pager = callback;
+  pager_count = count;
+
+  // Everything the pager has so far is older than the lines kept in memory
+  paged_lines = count();
+  for (int i = 0; i < UI_SCROLLBACK; i++) lines[i].paged = paged_lines;
+  pthread_mutex_unlock(&ui_lock);
+}
+
 /**
  * Stop the user interface and clean up.
  */
@@ -238,6 +490,12 @@ void ui_exit() {
   free_field(input_fields[0]);
   endwin();
 
+  for (int i = 0; i < UI_SCROLLBACK; i++) {
+    free(lines[i].text);
+    lines[i].text = NULL;
+  }
+  free_fetched();
+
   // Unlock the UI
   pthread_mutex_unlock(&ui_lock);
 }
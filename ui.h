@@ -1,6 +1,8 @@
 #if !defined(UI_H)
 #define UI_H
 
+#include <stddef.h>
+
 /**
  * The type of a callback function run by the user interface every time there is
  * a new message provided in the input pane. The parameter points to memory that
@@ -9,6 +11,19 @@
  */
 typedef void (*input_callback_t)(const char*);
 
+/**
+ * The type of a callback function that fetches scrollback for the display
+ * pane: up to count lines, oldest first, ending just before line end, where
+ * the oldest line is 0. It stores lines allocated with malloc in lines, which
+ * the user interface frees, and returns how many it stored.
+ */
+typedef size_t (*ui_pager_t)(size_t end, size_t count, char** lines);
+
+/**
+ * The type of a callback function that counts the lines a ui_pager_t has.
+ */
+typedef size_t (*ui_pager_count_t)();
+
 /**
  * Initialize the user interface and set up a callback function that should be
  * called every time there is a new message to send.
@@ -36,6 +51,20 @@ void ui_run();
  */
 void ui_display(const char* username, const char* message);
 
+/**
+ * Fetch scrollback that is older than the lines kept in memory from elsewhere.
+ * Only the last few hundred lines are kept, so without a pager the display
+ * pane cannot scroll back further than that. Lines shown after this call are
+ * expected to reach the pager as they are shown, if they reach it at all.
+ * Lines that never reach it, like notices, are only kept in memory, so once
+ * they are older than the last few hundred lines they are gone from
+ * scrollback.
+ *
+ * \param callback  A function that returns older lines for the display pane.
+ * \param count     A function that counts the lines callback can return.
+ */
+void ui_set_pager(ui_pager_t callback, ui_pager_count_t count);
+
 /**
  * Stop the user interface and clean up.
  */
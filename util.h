@@ -0,0 +1,65 @@
+#if !defined(UTIL_H)
+#define UTIL_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Largest file descriptor that per-peer state can be kept for
+#define LINK_MAX_FD 4096
+
+/**
+ * Per-peer state kept by a module, indexed by the peer's file descriptor.
+ * Lookups take no lock. Each module allocates its own entries and serializes
+ * its own changes to the table.
+ */
+typedef _Atomic(void*) link_table[LINK_MAX_FD];
+
+/**
+ * Look up the entry for a peer.
+ *
+ * \returns   The entry, or NULL if there is none.
+ */
+static inline void* link_get(link_table table, int fd) {
+  if (fd < 0 || fd >= LINK_MAX_FD) return NULL;
+  return atomic_load_explicit(&table[fd], memory_order_acquire);
+}
+
+/**
+ * Store the entry for a peer, or NULL to forget it.
+ *
+ * \returns   false if the file descriptor is too large to be kept.
+ */
+static inline bool link_set(link_table table, int fd, void* entry) {
+  if (fd < 0 || fd >= LINK_MAX_FD) return false;
+  atomic_store_explicit(&table[fd], entry, memory_order_release);
+  return true;
+}
+
+/**
+ * Hash some bytes with 64-bit FNV-1a.
+ */
+static inline uint64_t hash_bytes(const void* data, size_t len) {
+  const unsigned char* c = data;
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= c[i];
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+/**
+ * Read the monotonic clock.
+ *
+ * \returns   Nanoseconds since an arbitrary starting point.
+ */
+static inline uint64_t now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+#endif
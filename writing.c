@@ -8,9 +8,13 @@
 
 #include "socket.h"
 #include "ui.h"
+#include "local.h"
 
 // Helper function to write all the required bytes
 ssize_t write_helper(int fd, const void* buf, size_t len) {
+  // Peers on this host are written through their shared memory ring
+  if (local_is_link(fd)) return local_write(fd, buf, len);
+
   size_t bytes_written = 0;
   const char* ptr = buf;
 